@@ -0,0 +1,566 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// benchmarks of the allocator linked into this program: it only uses the
+// standard interface, so it runs on glibc and, with
+// LD_PRELOAD=./libmalloc.so, on this allocator
+//
+// the batch workload also uses malloc_batch and free_batch when the
+// allocator has them, and a loop of malloc and free otherwise
+//
+// usage: ./malloc.bench [label] [scale]
+// every workload runs in a child process of its own, so that its peak and
+// final RSS are not mixed with the other ones, and prints one JSON line
+
+// latency histogram: values below HIST_SUB_BUCKETS nanoseconds are exact,
+// bigger ones are split in HIST_SUB_BUCKETS linear sub buckets for each
+// power of two, which keeps the error of any percentile under 7%
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+#define QUEUE_SIZE 1024
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+};
+
+struct workload {
+	const char *name;
+	int threads;
+	void (*run)(struct histogram *hist, long scale);
+};
+
+static long bench_scale = 1;
+
+// usable bytes held by the workload, to tell the memory it uses apart from
+// the one lost to fragmentation
+static long live_bytes = 0;
+static long peak_live_bytes = 0;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int
+hist_index(uint64_t value)
+{
+	if (value < HIST_SUB_BUCKETS) {
+		return value;
+	}
+	int exponent = 63 - __builtin_clzll(value);
+	int sub = (value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+	return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// middle of the range of values counted by a bucket
+static uint64_t
+hist_value(int index)
+{
+	if (index < HIST_SUB_BUCKETS) {
+		return index;
+	}
+	int exponent = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+	uint64_t sub = index % HIST_SUB_BUCKETS;
+	uint64_t width = 1ULL << (exponent - HIST_SUB_BITS);
+	return ((HIST_SUB_BUCKETS + sub) << (exponent - HIST_SUB_BITS)) +
+	       width / 2;
+}
+
+static void
+hist_record(struct histogram *hist, uint64_t start, uint64_t end)
+{
+	hist->counts[hist_index(end - start)]++;
+	hist->total++;
+}
+
+// records `n` operations done in a single call, each taking its share
+static void
+hist_record_batch(struct histogram *hist,
+                  uint64_t start,
+                  uint64_t end,
+                  size_t n)
+{
+	hist->counts[hist_index((end - start) / n)] += n;
+	hist->total += n;
+}
+
+static void
+hist_merge(struct histogram *to, struct histogram *from)
+{
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		to->counts[i] += from->counts[i];
+	}
+	to->total += from->total;
+}
+
+static uint64_t
+hist_percentile(struct histogram *hist, double percentile)
+{
+	uint64_t rank = hist->total * percentile;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen > rank) {
+			return hist_value(i);
+		}
+	}
+	return 0;
+}
+
+// xorshift, each thread keeps its own state
+static uint64_t
+next_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static size_t
+random_size(uint64_t *state, size_t min, size_t max)
+{
+	return min + next_random(state) % (max - min + 1);
+}
+
+static void
+count_live(long bytes)
+{
+	long live = __atomic_add_fetch(&live_bytes, bytes, __ATOMIC_RELAXED);
+	long peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+	while (live > peak &&
+	       !__atomic_compare_exchange_n(&peak_live_bytes,
+	                                    &peak,
+	                                    live,
+	                                    true,
+	                                    __ATOMIC_RELAXED,
+	                                    __ATOMIC_RELAXED))
+		;
+}
+
+static void *
+timed_malloc(struct histogram *hist, size_t size)
+{
+	uint64_t start = now_ns();
+	char *ptr = malloc(size);
+	hist_record(hist, start, now_ns());
+	if (!ptr) {
+		fprintf(stderr, "malloc(%zu) failed\n", size);
+		exit(EXIT_FAILURE);
+	}
+	// the pages are touched, as a real program would
+	ptr[0] = 1;
+	ptr[size - 1] = 1;
+	count_live(malloc_usable_size(ptr));
+	return ptr;
+}
+
+static void
+timed_free(struct histogram *hist, void *ptr)
+{
+	count_live(-(long) malloc_usable_size(ptr));
+	uint64_t start = now_ns();
+	free(ptr);
+	hist_record(hist, start, now_ns());
+}
+
+// reads a field in kB of /proc/self/status
+static long
+status_kb(const char *field)
+{
+	char buf[4096];
+	int fd = open("/proc/self/status", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		return -1;
+	}
+	buf[len] = '\0';
+
+	char *line = strstr(buf, field);
+	return line ? strtol(line + strlen(field) + 1, NULL, 10) : -1;
+}
+
+// allocates and frees batches of every size class, from 16 bytes to 64KiB
+static void
+size_sweep(struct histogram *hist, long scale)
+{
+	enum { BATCH = 256 };
+	void *ptrs[BATCH];
+
+	for (long round = 0; round < 20 * scale; round++) {
+		for (size_t size = 16; size <= 64 * 1024; size += size / 4) {
+			for (int i = 0; i < BATCH; i++) {
+				ptrs[i] = timed_malloc(hist, size);
+			}
+			for (int i = 0; i < BATCH; i++) {
+				timed_free(hist, ptrs[i]);
+			}
+		}
+	}
+}
+
+// replaces random slots of a working set with new small allocations
+static void
+churn(struct histogram *hist, long scale)
+{
+	enum { SLOTS = 4096 };
+	void *slots[SLOTS] = { NULL };
+	uint64_t state = 88172645463325252ULL;
+
+	for (long i = 0; i < 500000 * scale; i++) {
+		int slot = next_random(&state) % SLOTS;
+		if (slots[slot]) {
+			timed_free(hist, slots[slot]);
+		}
+		slots[slot] = timed_malloc(hist, random_size(&state, 16, 1024));
+	}
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i]) {
+			timed_free(hist, slots[i]);
+		}
+	}
+}
+
+// single producer, single consumer queue of pointers
+struct queue {
+	void *items[QUEUE_SIZE];
+	size_t head;
+	size_t tail;
+	long count;
+	struct histogram hist;
+};
+
+static void *
+producer(void *arg)
+{
+	struct queue *queue = arg;
+	uint64_t state = (uintptr_t) arg | 1;
+
+	for (long i = 0; i < queue->count; i++) {
+		void *ptr = timed_malloc(&queue->hist,
+		                         random_size(&state, 16, 4096));
+		while (queue->head -
+		               __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) ==
+		       QUEUE_SIZE) {
+			sched_yield();
+		}
+		queue->items[queue->head % QUEUE_SIZE] = ptr;
+		__atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void *
+consumer(void *arg)
+{
+	struct queue *queue = arg;
+	struct histogram *hist = calloc(1, sizeof(*hist));
+
+	for (long i = 0; i < queue->count; i++) {
+		while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) ==
+		       queue->tail) {
+			sched_yield();
+		}
+		void *ptr = queue->items[queue->tail % QUEUE_SIZE];
+		__atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+		timed_free(hist, ptr);
+	}
+	return hist;
+}
+
+// every pointer is allocated by a producer and freed by its consumer
+static void
+producer_consumer(struct histogram *hist, long scale)
+{
+	enum { PAIRS = 2 };
+	struct queue *queues = calloc(PAIRS, sizeof(struct queue));
+	pthread_t threads[2 * PAIRS];
+
+	for (int i = 0; i < PAIRS; i++) {
+		queues[i].count = 200000 * scale;
+		pthread_create(&threads[2 * i], NULL, producer, &queues[i]);
+		pthread_create(&threads[2 * i + 1], NULL, consumer, &queues[i]);
+	}
+	for (int i = 0; i < PAIRS; i++) {
+		void *consumer_hist;
+		pthread_join(threads[2 * i], NULL);
+		pthread_join(threads[2 * i + 1], &consumer_hist);
+		hist_merge(hist, &queues[i].hist);
+		hist_merge(hist, consumer_hist);
+		free(consumer_hist);
+	}
+	free(queues);
+}
+
+// larson: each thread replaces random slots of a working set that was
+// allocated by the thread before it, and then hands it to a new thread
+struct larson_slots {
+	void *slots[1024];
+	long replacements;
+	uint64_t state;
+	struct histogram hist;
+};
+
+static void *
+larson_thread(void *arg)
+{
+	struct larson_slots *set = arg;
+
+	for (long i = 0; i < set->replacements; i++) {
+		int slot = next_random(&set->state) % 1024;
+		if (set->slots[slot]) {
+			timed_free(&set->hist, set->slots[slot]);
+		}
+		set->slots[slot] = timed_malloc(&set->hist,
+		                                random_size(&set->state, 16, 512));
+	}
+	return NULL;
+}
+
+static void
+larson(struct histogram *hist, long scale)
+{
+	enum { THREADS = 4, ROUNDS = 10 };
+	struct larson_slots *sets = calloc(THREADS, sizeof(struct larson_slots));
+	pthread_t threads[THREADS];
+
+	for (int i = 0; i < THREADS; i++) {
+		sets[i].replacements = 20000 * scale;
+		sets[i].state = 0x9e3779b97f4a7c15ULL * (i + 1);
+	}
+	for (int round = 0; round < ROUNDS; round++) {
+		for (int i = 0; i < THREADS; i++) {
+			pthread_create(&threads[i], NULL, larson_thread, &sets[i]);
+		}
+		for (int i = 0; i < THREADS; i++) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	for (int i = 0; i < THREADS; i++) {
+		for (int j = 0; j < 1024; j++) {
+			if (sets[i].slots[j]) {
+				timed_free(&sets[i].hist, sets[i].slots[j]);
+			}
+		}
+		hist_merge(hist, &sets[i].hist);
+	}
+	free(sets);
+}
+
+// grows buffers with realloc from 16 bytes to 4MiB, as a string builder would
+static void
+realloc_growth(struct histogram *hist, long scale)
+{
+	enum { CHAINS = 8 };
+	void *chains[CHAINS];
+
+	for (long round = 0; round < 50 * scale; round++) {
+		for (int i = 0; i < CHAINS; i++) {
+			chains[i] = timed_malloc(hist, 16);
+		}
+		for (size_t size = 16; size <= 4 * 1024 * 1024;
+		     size += size / 2) {
+			for (int i = 0; i < CHAINS; i++) {
+				long old_size = malloc_usable_size(chains[i]);
+				uint64_t start = now_ns();
+				char *ptr = realloc(chains[i], size);
+				hist_record(hist, start, now_ns());
+				ptr[size - 1] = 1;
+				chains[i] = ptr;
+				count_live(malloc_usable_size(ptr) - old_size);
+			}
+		}
+		for (int i = 0; i < CHAINS; i++) {
+			timed_free(hist, chains[i]);
+		}
+	}
+}
+
+// leaves small holes between long lived allocations and then asks for
+// sizes that do not fit in them
+static void
+fragmentation(struct histogram *hist, long scale)
+{
+	enum { COUNT = 20000 };
+	void **ptrs = calloc(COUNT, sizeof(void *));
+	void **bigger = calloc(COUNT / 2, sizeof(void *));
+	uint64_t state = 0x2545f4914f6cdd1dULL;
+
+	for (long round = 0; round < 5 * scale; round++) {
+		for (int i = 0; i < COUNT; i++) {
+			ptrs[i] = timed_malloc(hist, random_size(&state, 64, 2048));
+		}
+		for (int i = 0; i < COUNT; i += 2) {
+			timed_free(hist, ptrs[i]);
+		}
+		for (int i = 0; i < COUNT / 2; i++) {
+			bigger[i] = timed_malloc(hist,
+			                         random_size(&state, 2048, 8192));
+		}
+		for (int i = 1; i < COUNT; i += 2) {
+			timed_free(hist, ptrs[i]);
+		}
+		for (int i = 0; i < COUNT / 2; i++) {
+			timed_free(hist, bigger[i]);
+		}
+	}
+	free(ptrs);
+	free(bigger);
+}
+
+// parses messages: the nodes of a message are allocated together and freed
+// together once it is handled
+static void
+batch(struct histogram *hist, long scale)
+{
+	enum { NODES = 256 };
+	static const size_t sizes[] = { 48, 320 };
+	void *nodes[NODES];
+	size_t (*malloc_batch)(size_t, size_t, void **) =
+	        dlsym(RTLD_DEFAULT, "malloc_batch");
+	void (*free_batch)(void **, size_t) = dlsym(RTLD_DEFAULT, "free_batch");
+
+	for (long round = 0; round < 4000 * scale; round++) {
+		size_t size = sizes[round % 2];
+		uint64_t start = now_ns();
+		if (malloc_batch) {
+			if (malloc_batch(size, NODES, nodes) != NODES) {
+				fprintf(stderr, "malloc_batch(%zu) failed\n", size);
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			for (int i = 0; i < NODES; i++) {
+				nodes[i] = malloc(size);
+			}
+		}
+		hist_record_batch(hist, start, now_ns(), NODES);
+		for (int i = 0; i < NODES; i++) {
+			((char *) nodes[i])[0] = 1;
+			count_live(malloc_usable_size(nodes[i]));
+		}
+
+		for (int i = 0; i < NODES; i++) {
+			count_live(-(long) malloc_usable_size(nodes[i]));
+		}
+		start = now_ns();
+		if (free_batch) {
+			free_batch(nodes, NODES);
+		} else {
+			for (int i = 0; i < NODES; i++) {
+				free(nodes[i]);
+			}
+		}
+		hist_record_batch(hist, start, now_ns(), NODES);
+	}
+}
+
+static struct workload workloads[] = {
+	{ "size_sweep", 1, size_sweep },
+	{ "churn", 1, churn },
+	{ "producer_consumer", 4, producer_consumer },
+	{ "larson", 4, larson },
+	{ "realloc_growth", 1, realloc_growth },
+	{ "fragmentation", 1, fragmentation },
+	{ "batch", 1, batch },
+};
+
+static void
+run_workload(const char *label, struct workload *workload)
+{
+	// the peak RSS of the child starts as the one of its parent
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd >= 0) {
+		if (write(fd, "5", 1) < 0) {
+			perror("clear_refs");
+		}
+		close(fd);
+	}
+
+	struct histogram *hist = calloc(1, sizeof(*hist));
+	long base_rss = status_kb("VmRSS:");
+	uint64_t start = now_ns();
+	workload->run(hist, bench_scale);
+	double seconds = (now_ns() - start) / 1e9;
+
+	// the share of the peak RSS of the heap that was not held by the
+	// workload, the RSS of the program itself is left out
+	long peak_rss = status_kb("VmHWM:");
+	long heap_rss = peak_rss - base_rss;
+	long peak_live = peak_live_bytes / 1024;
+	double fragmentation =
+	        heap_rss > peak_live ? 1.0 - (double) peak_live / heap_rss : 0;
+
+	printf("{\"allocator\": \"%s\", \"workload\": \"%s\", \"threads\": %d, "
+	       "\"ops\": %" PRIu64 ", \"ops_per_sec\": %.0f, "
+	       "\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", "
+	       "\"p999_ns\": %" PRIu64 ", \"peak_rss_kb\": %ld, "
+	       "\"final_rss_kb\": %ld, \"peak_live_kb\": %ld, "
+	       "\"fragmentation\": %.3f}\n",
+	       label,
+	       workload->name,
+	       workload->threads,
+	       hist->total,
+	       hist->total / seconds,
+	       hist_percentile(hist, 0.5),
+	       hist_percentile(hist, 0.99),
+	       hist_percentile(hist, 0.999),
+	       peak_rss,
+	       status_kb("VmRSS:"),
+	       peak_live,
+	       fragmentation);
+	fflush(stdout);
+	free(hist);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *label = argc > 1 ? argv[1] : "default";
+	if (argc > 2) {
+		bench_scale = strtol(argv[2], NULL, 10);
+		if (bench_scale < 1) {
+			bench_scale = 1;
+		}
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			run_workload(label, &workloads[i]);
+			_exit(EXIT_SUCCESS);
+		}
+		int status;
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != EXIT_SUCCESS) {
+			fprintf(stderr, "%s: workload failed\n", workloads[i].name);
+			failed = 1;
+		}
+	}
+	return failed;
+}
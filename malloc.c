@@ -1,17 +1,31 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <stdio.h>
 #include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
 
 #include "malloc.h"
 #include "printfmt.h"
+#include "trace.h"
 
+// defaults of the settings that can be changed with MALLOC_CONF
 #define LITTLE_BLOCK_SIZE 16 * 1024
 #define MID_BLOCK_SIZE 1024 * 1024
 #define LARGE_BLOCK_SIZE 32 * MID_BLOCK_SIZE
@@ -19,433 +33,5375 @@
 #define MAX_LITTLE_BLOCKS 25
 #define MAX_MID_BLOCKS 50
 #define MAX_LARGE_BLOCKS 25
-#define MAGIC_NUMBER 517283971
+#define MAX_BLOCK_SIZE (1024UL * 1024 * 1024)
+#define MAGIC_NUMBER 0x1d83  // fits in the 13 bits kept for it
+#define MIN_ALIGNMENT 16
+#define REGION_SIZE_BITS 43
+#define REGION_MAX_SIZE ((1UL << REGION_SIZE_BITS) - 1)
+#define REGION_MAX_OFFSET ((size_t) UINT32_MAX * MIN_ALIGNMENT)
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 4
+#define MAX_NUMA_NODES 16
 
-#define ALIGN4(s) (((((s) -1) >> 2) << 2) + 4)
+// huge regions: requests that do not fit in a large block get a mapping of
+// their own, up to HUGE_CACHE_SIZE freed mappings of at most
+// HUGE_CACHE_MAX_SIZE bytes are kept to be reused, with their pages purged,
+// and unmapped once they were not used for BLOCK_CACHE_DECAY_MS
+// empty blocks: up to BLOCK_CACHE_SIZE empty blocks of each type, and at
+// most BLOCK_CACHE_MAX_BYTES bytes, are kept by each arena to be reused
+// and unmapped once they were not used for BLOCK_CACHE_DECAY_MS
+#define BLOCK_CACHE_SIZE 16
+#define BLOCK_CACHE_MAX_BYTES (40UL * 1024 * 1024)
+#define BLOCK_CACHE_DECAY_MS 10000
+
+// purging: the whole pages of the free regions are given back to the
+// kernel along a decay curve of purge_decay_ms, split in PURGE_DECAY_STEPS
+// epochs, with a purge pass at the end of each one
+#define PURGE_DECAY_MS 10000
+#define PURGE_DECAY_STEPS 16
+#define PURGE_MIN_INTERVAL_MS 10
+
+// huge pages: mid and large blocks may be backed by pages of
+// HUGE_PAGE_SIZE, they are then mapped aligned to it and hold whole ones
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// tracing: each thread keeps up to TRACE_BUFFER_RECORDS records before
+// writing them to the trace file
+#define TRACE_BUFFER_RECORDS 1024
+
+// heap profiling: an allocation is sampled every prof_sample bytes on
+// average, keeping up to PROF_MAX_DEPTH frames of its call stack in a table
+// of PROF_STACKS stacks, with up to PROF_SAMPLES live samples
+#define PROF_MAX_DEPTH 32
+#define PROF_STACKS 4096
+#define PROF_SAMPLES (64 * 1024)
+
+#define HUGE_MAGIC_NUMBER 0x0b29
+#define HUGE_CACHE_SIZE 4
+#define HUGE_CACHE_MAX_SIZE (256UL * 1024 * 1024)
+
+// thread cache: small regions up to TCACHE_MAX_SIZE are kept per thread
+// in bins of TCACHE_SIZE_STEP bytes, at most TCACHE_BIN_MAX per bin
+#define TCACHE_MAX_SIZE 1024
+#define TCACHE_SIZE_STEP 64
+#define TCACHE_BIN_COUNT (TCACHE_MAX_SIZE / TCACHE_SIZE_STEP + 1)
+#define TCACHE_BIN_MAX 16
+#define TCACHE_FLUSH_BATCH (TCACHE_BIN_MAX / 2)
+
+// slabs: objects up to SLAB_MAX_SIZE are kept without headers in size
+// classes of SLAB_SIZE_STEP bytes, inside slabs of SLAB_SIZE bytes
+// carved out of a single reserved range of SLAB_ZONE_SIZE bytes
+#define SLAB_MAX_SIZE 256
+#define SLAB_SIZE_STEP 16
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_SIZE_STEP)
+#define SLAB_SIZE (16 * 1024)
+#define SLAB_HEADER_SIZE 64
+#define SLAB_ZONE_SIZE (1024UL * 1024 * 1024)
+
+#define ALIGN16(s) (((((s) -1) >> 4) << 4) + 16)
+#define ALIGN_UP(x, a) (((x) + (a) -1) & ~((uintptr_t) (a) -1))
 #define REGION2PTR(r) ((r) + 1)
 #define PTR2REGION(ptr) ((struct region *) (ptr) -1)
+#define FIRST_REGION(b) ((struct region *) ((b) + 1))
+#define ALIGN_TCACHE(s)                                                        \
+	((((s) + TCACHE_SIZE_STEP - 1) / TCACHE_SIZE_STEP) * TCACHE_SIZE_STEP)
+#define SLAB_CLASS(s) ((s) > SLAB_SIZE_STEP ? ((s) -1) / SLAB_SIZE_STEP : 0)
+#define SLAB_CLASS_SIZE(c) (((c) + 1) * SLAB_SIZE_STEP)
+#define PTR2SLAB(ptr)                                                          \
+	((struct slab *) ((uintptr_t) (ptr) & ~((uintptr_t) SLAB_SIZE - 1)))
+
+// counters written only by their owner thread and read by any thread
+#define COUNTER_ADD(counter, n)                                                \
+	__atomic_store_n(&(counter),                                           \
+	                 __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n),  \
+	                 __ATOMIC_RELAXED)
+#define COUNTER_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// statistics: classes of usable sizes kept for each thread
+#define STATS_SIZE_CLASSES (REGION_SIZE_BITS + 1)
+
+// thread variables live in the static TLS block, so that reaching them never
+// allocates, not even when the library is loaded with LD_PRELOAD
+#define TLS_MODEL __attribute__((tls_model("initial-exec")))
+
+// pages that back a block
+enum block_pages { PAGES_BASE, PAGES_THP, PAGES_HUGETLB };
 
 struct block {
 	struct block *next;
 	struct block *previous;
-	struct region *first_region;
+	size_t size : 62;
+	size_t pages : 2;  // enum block_pages
+	struct arena *arena;
 };
 
+// the header of a region takes 16 bytes: its neighbours are found from
+// its size and from the distance to the previous header, both the previous
+// header and the block are at most REGION_MAX_OFFSET bytes behind it
+// the magic number shares the last word with the size and the flags, so it
+// is the word right before the payload
 struct region {
-	bool free;
-	size_t size;
+	uint32_t prev_offset;   // in MIN_ALIGNMENT units, 0 for the first one
+	uint32_t block_offset;  // in MIN_ALIGNMENT units
+	size_t size : REGION_SIZE_BITS;
+	size_t free : 1;
+	size_t purged : 1;
+	size_t zeroed : 1;
+	size_t last : 1;  // there is no region after it in the block
+	size_t sampled : 1;  // tracked by the heap profiler
+	size_t magic_number : 13;
+};
+
+// payloads follow the headers, which keep them aligned
+_Static_assert(sizeof(struct block) % MIN_ALIGNMENT == 0,
+               "block header breaks alignment");
+_Static_assert(sizeof(struct region) % MIN_ALIGNMENT == 0,
+               "region header breaks alignment");
+_Static_assert(sizeof(struct region) == 16, "region header is not compact");
+_Static_assert(MAX_BLOCK_SIZE <= REGION_MAX_OFFSET,
+               "region offsets do not cover a block");
+
+// header at the start of every slab, its objects follow it
+struct slab {
+	struct slab *next;
+	struct slab *prev;
+	struct arena *arena;
+	void *free_objects;
+	unsigned int next_unused;
+	unsigned short used;
+	unsigned short capacity;
+	int size_class;
+};
+
+// a cached pointer keeps the bin list inside the memory it points to
+struct tcache_entry {
+	struct tcache_entry *next;
+	struct tcache *key;
+};
+
+struct tcache_bin {
+	struct tcache_entry *head;
+	int count;
+};
+
+enum tcache_state { TCACHE_UNUSED, TCACHE_ACTIVE, TCACHE_DISABLED };
+
+// counters kept by each thread, without locking
+//
+// usable sizes are counted in classes of powers of two: class i holds the
+// sizes bigger than 2^(i-1) and up to 2^i bytes
+struct thread_stats {
+	uint64_t mallocs;
+	uint64_t frees;
+	uint64_t requested_memory;
+	// usable bytes handed out minus the ones given back, the ones freed
+	// by another thread are subtracted from the counter of that thread
+	int64_t allocated;
+	uint64_t class_mallocs[STATS_SIZE_CLASSES];
+	uint64_t class_frees[STATS_SIZE_CLASSES];
+};
+
+struct tcache {
+	enum tcache_state state;
+	struct tcache_bin bins[TCACHE_BIN_COUNT];
+	struct tcache_bin slab_bins[SLAB_CLASSES];
+
+	// statistics of the thread, merged into the globals when it exits
+	struct thread_stats stats;
+
+	// bytes left until the next sampled allocation and the state of the
+	// random numbers that choose it
+	int64_t prof_bytes;
+	uint64_t prof_seed;
+	bool prof_busy;
+
+	struct tcache *next;
+	struct tcache *prev;
+};
+
+#ifdef TLSF
+// two-level segregated fit index
+//
+// the first level splits sizes in powers of two, up to the biggest size
+// a region header holds, and the second level splits each power of two in
+// TLSF_SL_COUNT linear ranges. Free regions are linked through their own
+// payload, which is always at least min_size_region bytes long.
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_COUNT REGION_SIZE_BITS
+
+_Static_assert(TLSF_FL_COUNT <= 64, "first level does not fit in the bitmap");
+_Static_assert(TLSF_SL_COUNT <= 32, "second level does not fit in the bitmap");
+
+#define REGION2LINKS(r) ((struct free_links *) REGION2PTR(r))
+
+struct free_links {
+	struct region *next_free;
+	struct region *prev_free;
+};
+
+struct tlsf_index {
+	uint64_t fl_bitmap;
+	unsigned int sl_bitmap[TLSF_FL_COUNT];
+	struct region *heads[TLSF_FL_COUNT][TLSF_SL_COUNT];
+};
+#endif
+
+// node of the red-black tree of the free regions of a block list searched
+// by best fit, kept in the payload of the region and ordered by size and
+// then by address. The color is the lowest bit of the parent, regions are
+// aligned to 16 bytes.
+#define REGION2NODE(r) ((struct tree_node *) REGION2PTR(r))
+#define TREE_RED 1UL
+
+struct tree_node {
+	struct region *child[2];
+	uintptr_t parent_color;
+};
+
+// links of a free region in the dirty list of its arena, kept after the
+// ones of the free region index
+#define REGION2DIRTY(r)                                                        \
+	((struct dirty_links *) ((char *) REGION2PTR(r) +                      \
+	                         sizeof(struct tree_node)))
+
+struct dirty_links {
 	struct region *next;
 	struct region *prev;
-	int magic_number;
+};
+
+// bytes at the start of a free region written by the free region index
+// and the dirty list
+// a region is only in the index of the policy of its block type, so the
+// links of every index start at the payload
+#define FREE_REGION_LINKS_SIZE                                                 \
+	(sizeof(struct tree_node) + sizeof(struct dirty_links))
+#ifdef TLSF
+_Static_assert(sizeof(struct free_links) <= FREE_REGION_LINKS_SIZE,
+               "free links do not fit before the purged pages");
+#endif
+
+// types of blocks, from the smallest to the largest
+enum block_type { LITTLE_BLOCK, MID_BLOCK, LARGE_BLOCK, BLOCK_TYPES };
+
+// ways to look for a free region, chosen for each type of block
+enum fit_policy {
+	FIT_NONE,
+	FIT_FIRST,
+	FIT_BEST,
+	FIT_ADDRESS,  // first fit with the blocks kept in address order
+	FIT_NEXT,     // first fit from where the last search ended
+	FIT_TLSF,
+	FIT_POLICIES,
+};
+
+#if defined(TLSF)
+#define DEFAULT_FIT FIT_TLSF
+#elif defined(ADDRESS_FIT)
+#define DEFAULT_FIT FIT_ADDRESS
+#elif defined(NEXT_FIT)
+#define DEFAULT_FIT FIT_NEXT
+#elif defined(BEST_FIT)
+#define DEFAULT_FIT FIT_BEST
+#elif defined(FIRST_FIT)
+#define DEFAULT_FIT FIT_FIRST
+#else
+#define DEFAULT_FIT FIT_NONE
+#endif
+
+// settings of the block types, MALLOC_CONF may change them
+// before the first block is created
+static size_t block_sizes[BLOCK_TYPES] = {
+	LITTLE_BLOCK_SIZE,
+	MID_BLOCK_SIZE,
+	LARGE_BLOCK_SIZE,
+};
+
+static int max_blocks[BLOCK_TYPES] = {
+	MAX_LITTLE_BLOCKS,
+	MAX_MID_BLOCKS,
+	MAX_LARGE_BLOCKS,
+};
+
+static enum fit_policy fit_policies[BLOCK_TYPES] = {
+	DEFAULT_FIT,
+	DEFAULT_FIT,
+	DEFAULT_FIT,
+};
+
+static const char *fit_names[FIT_POLICIES] = {
+	[FIT_NONE] = "none",
+	[FIT_FIRST] = "first",
+	[FIT_BEST] = "best",
+	[FIT_ADDRESS] = "address",
+	[FIT_NEXT] = "next",
+	[FIT_TLSF] = "tlsf",
+};
+
+static size_t min_size_region = MIN_SIZE_REGION;
+
+static const int max_empty_blocks[BLOCK_TYPES] = {
+	BLOCK_CACHE_SIZE,
+	BLOCK_CACHE_SIZE / 2,
+	2,
+};
+
+struct block_list {
+	struct block *first;
+	struct block *last;
+	int amount_of_blocks;
+
+	// region where the last next fit search ended, or NULL
+	struct region *rover;
+
+	// root of the tree of free regions used by best fit
+	struct region *tree;
+
+	// empty blocks kept to be reused, from the oldest to the newest
+	struct block *empty_blocks[BLOCK_CACHE_SIZE];
+	uint64_t empty_since[BLOCK_CACHE_SIZE];
+	int amount_of_empty_blocks;
+#ifdef TLSF
+	struct tlsf_index index;
+#endif
+};
+
+// an independent heap with its own lock
+//
+// each thread allocates from a single arena of its NUMA node, and a region
+// always goes back to the arena of its block
+struct arena {
+	pthread_mutex_t lock;
+	unsigned int node;
+	struct block_list blocks[BLOCK_TYPES];
+	int amount_of_regions;
+	size_t empty_bytes;
+
+	// free regions with whole pages that were not purged, from the oldest
+	// to the newest, and the bytes of those pages
+	struct region *dirty_first;
+	struct region *dirty_last;
+	size_t dirty_bytes;
+	// bytes made dirty in each of the last PURGE_DECAY_STEPS epochs, the
+	// newest first, and the dirty bytes left by the last purge pass
+	size_t dirty_backlog[PURGE_DECAY_STEPS];
+	size_t decay_dirty;
+	uint64_t last_purge;
+	uint64_t purged_bytes;
+
+	// slabs with free objects, one list for each size class
+	struct slab *slabs[SLAB_CLASSES];
+	int amount_of_slabs;
+
+	// an empty slab of each size class is kept in its list to be reused,
+	// and given back to the zone once it was not used for
+	// BLOCK_CACHE_DECAY_MS
+	struct slab *empty_slabs[SLAB_CLASSES];
+	uint64_t empty_slab_since[SLAB_CLASSES];
+	int amount_of_empty_slabs;
+
+	// pointers given back from the remote free queue
+	uint64_t remote_frees;
+
+	// queue of the pointers freed by the threads of other arenas, pushed
+	// without the lock and given back by the threads of the arena, in a
+	// cache line of its own so that the pushes do not slow down the lock
+	struct remote_free *remote_queue __attribute__((aligned(64)));
+};
+
+// a pointer in the remote free queue of an arena keeps the link in its own
+// memory, regions and slab objects hold at least 16 bytes
+struct remote_free {
+	struct remote_free *next;
 };
 
 // First block initialization
 
-struct block *little_blocks = NULL;
-struct block *mid_blocks = NULL;
-struct block *large_blocks = NULL;
+static struct arena arenas[MAX_ARENAS] = {
+	[0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static unsigned int amount_of_arenas = 1;
+static unsigned int next_arena[MAX_NUMA_NODES];
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static __thread struct arena *thread_arena TLS_MODEL = NULL;
+
+// range reserved for the slabs, which never moves once created
+static char *slab_zone = NULL;
+static size_t slab_zone_used = 0;
+static struct slab *free_slabs = NULL;
+static pthread_mutex_t slab_zone_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_zone_once = PTHREAD_ONCE_INIT;
+
+// freed huge mappings kept to be reused and when they were freed, and huge
+// regions in use, which are linked to find their pages when the resident
+// memory is measured
+static struct block *huge_cache[HUGE_CACHE_SIZE];
+static uint64_t huge_cache_since[HUGE_CACHE_SIZE];
+static int huge_cache_next = 0;
+static struct block *huge_blocks = NULL;
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static int amount_of_huge_blocks = 0;
+static size_t huge_bytes = 0;
+
+// huge pages of the mid and large blocks, set with MALLOC_CONF
+enum huge_pages_mode { HUGE_PAGES_NONE, HUGE_PAGES_THP, HUGE_PAGES_HUGETLB };
+
+static const char *huge_pages_names[] = {
+	[HUGE_PAGES_NONE] = "none",
+	[HUGE_PAGES_THP] = "thp",
+	[HUGE_PAGES_HUGETLB] = "hugetlb",
+};
+
+static enum huge_pages_mode huge_pages = HUGE_PAGES_NONE;
+// once a MAP_HUGETLB mapping fails, transparent huge pages are used
+static bool hugetlb_failed = false;
+
+// NUMA nodes: arena i belongs to node i % amount_of_nodes, and the pages
+// of its blocks are taken from that node
+// the nodes are numbered from 0 to amount_of_nodes - 1, node_ids has the
+// id the kernel gives each one, which may have gaps like 0 and 2
+// numa_nodes is set with MALLOC_CONF, 0 uses the nodes of the machine, and
+// other amounts are emulated by giving the nodes to the threads in turn,
+// without binding any memory
+static long numa_nodes = 0;
+static unsigned int amount_of_nodes = 1;
+static bool numa_bind = false;
+static unsigned int node_ids[MAX_NUMA_NODES];
+static unsigned int next_node = 0;
+
+// blocks mapped ahead of time by malloc_reserve, or by the reserve options
+// of MALLOC_CONF, for each node: an arena of the node takes one before
+// mapping a new block of its type, they are linked by their next field
+static struct block *reserved_blocks[MAX_NUMA_NODES][BLOCK_TYPES];
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t reserve_counts[BLOCK_TYPES];
+static int reserve_flags = 0;
+
+// purging settings, read from MALLOC_CONF at startup
+static long purge_decay_ms = PURGE_DECAY_MS;
+static bool background_thread = false;
+static bool background_purge = false;
+#ifdef MADV_FREE
+static int purge_advice = MADV_FREE;
+#else
+static int purge_advice = MADV_DONTNEED;
+#endif
+
+// allocation trace, written only if MALLOC_TRACE_FILE is set
+struct trace_buffer {
+	struct trace_buffer *next;
+	int count;
+	struct trace_record records[TRACE_BUFFER_RECORDS];
+};
+
+static int trace_fd = -1;
+static uint64_t trace_start;
+static uint16_t trace_threads = 0;
+static __thread uint16_t trace_thread TLS_MODEL;
+static __thread struct trace_buffer *trace_buffer TLS_MODEL;
+// buffers of the threads that exited, to be reused by new ones
+static struct trace_buffer *trace_free_buffers = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// heap profile, enabled with prof_sample in MALLOC_CONF or with mallctl
+//
+// a call stack is kept once with the counters of its samples, the live
+// samples are found by their pointer when they are freed
+struct prof_stack {
+	uint64_t hash;
+	int depth;
+	void *frames[PROF_MAX_DEPTH];
+	uint64_t live_objects;
+	uint64_t live_bytes;
+	uint64_t allocated_objects;
+	uint64_t allocated_bytes;
+};
+
+struct prof_sample {
+	void *ptr;
+	size_t size;
+	struct prof_stack *stack;
+};
+
+static size_t prof_interval = 0;
+static bool prof_ready = false;
+static int prof_signal = 0;
+static const char *prof_prefix = "malloc";
+static int prof_prefix_len = 6;
+static struct prof_stack *prof_stacks;
+static struct prof_sample *prof_samples;
+static uint64_t prof_dropped = 0;
+static size_t prof_live_samples = 0;
+static unsigned int prof_dumps = 0;
+static volatile sig_atomic_t prof_dump_pending = false;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t prof_once = PTHREAD_ONCE_INIT;
+
+// statistics of the threads that already exited
+static struct thread_stats exited_stats;
+
+// bytes mapped for the heap and their high-water mark
+static size_t mapped_bytes = 0;
+static size_t mapped_peak = 0;
+
+// protects the list of caches and the counters above
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// caches of the live threads, linked to read their statistics
+static struct tcache *tcaches = NULL;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static __thread struct tcache tcache TLS_MODEL;
+
+// the block that holds a region
+static struct block *
+region_block(struct region *region)
+{
+	return (struct block *) ((char *) region -
+	                         (size_t) region->block_offset * MIN_ALIGNMENT);
+}
+
+static void
+set_region_block(struct region *region, struct block *block)
+{
+	region->block_offset =
+	        ((char *) region - (char *) block) / MIN_ALIGNMENT;
+}
+
+// the region that follows a region in its block, NULL for the last one
+static struct region *
+region_next(struct region *region)
+{
+	if (region->last) {
+		return NULL;
+	}
+	return (struct region *) ((char *) REGION2PTR(region) + region->size);
+}
+
+// the region that precedes a region in its block, NULL for the first one
+static struct region *
+region_prev(struct region *region)
+{
+	if (!region->prev_offset) {
+		return NULL;
+	}
+	return (struct region *) ((char *) region -
+	                          (size_t) region->prev_offset * MIN_ALIGNMENT);
+}
+
+// makes `prev` the region before `region`
+static void
+set_region_prev(struct region *region, struct region *prev)
+{
+	region->prev_offset = ((char *) region - (char *) prev) / MIN_ALIGNMENT;
+}
+
+// prints an error like perror(3), which may allocate while it formats it
+static void
+print_error(const char *message)
+{
+	char buf[128];
+	const char *description = strerror_r(errno, buf, sizeof(buf));
+	const char *parts[] = { message, ": ", description, "\n" };
+	for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		if (write(STDERR_FILENO, parts[i], strlen(parts[i])) < 0) {
+			return;
+		}
+	}
+}
+
+// prints a warning about the `len` bytes of a MALLOC_CONF option
+static void
+print_conf_error(const char *message, const char *option, size_t len)
+{
+	if (write(STDERR_FILENO, "MALLOC_CONF: ", 13) < 0 ||
+	    write(STDERR_FILENO, message, strlen(message)) < 0 ||
+	    write(STDERR_FILENO, option, len) < 0) {
+		return;
+	}
+	if (write(STDERR_FILENO, "\n", 1) < 0) {
+		return;
+	}
+}
+
+static struct region *
+tree_parent(struct region *region)
+{
+	uintptr_t parent = REGION2NODE(region)->parent_color & ~TREE_RED;
+	return (struct region *) parent;
+}
+
+static void
+tree_set_parent(struct region *region, struct region *parent)
+{
+	struct tree_node *node = REGION2NODE(region);
+	node->parent_color =
+	        (uintptr_t) parent | (node->parent_color & TREE_RED);
+}
+
+// missing children are black
+static bool
+tree_is_red(struct region *region)
+{
+	return region && (REGION2NODE(region)->parent_color & TREE_RED);
+}
+
+static void
+tree_set_red(struct region *region, bool red)
+{
+	struct tree_node *node = REGION2NODE(region);
+	node->parent_color =
+	        (node->parent_color & ~TREE_RED) | (red ? TREE_RED : 0);
+}
+
+// the order of the tree: by size, and by address among the same size
+static bool
+tree_less(struct region *a, struct region *b)
+{
+	return a->size < b->size || (a->size == b->size && a < b);
+}
+
+// puts `new` where `old` was under `parent`, or as the root
+static void
+tree_replace_child(struct region **root,
+                   struct region *parent,
+                   struct region *old,
+                   struct region *new)
+{
+	if (!parent) {
+		*root = new;
+	} else {
+		struct tree_node *node = REGION2NODE(parent);
+		node->child[node->child[1] == old] = new;
+	}
+}
+
+// moves a region down to its child on side `dir`, the child on the other
+// side takes its place
+static void
+tree_rotate(struct region **root, struct region *region, int dir)
+{
+	struct tree_node *node = REGION2NODE(region);
+	struct region *up = node->child[!dir];
+	struct tree_node *up_node = REGION2NODE(up);
+	struct region *parent = tree_parent(region);
+
+	node->child[!dir] = up_node->child[dir];
+	if (up_node->child[dir]) {
+		tree_set_parent(up_node->child[dir], region);
+	}
+	up_node->child[dir] = region;
+	tree_set_parent(region, up);
+	tree_set_parent(up, parent);
+	tree_replace_child(root, parent, region, up);
+}
+
+static void
+tree_insert(struct region **root, struct region *region)
+{
+	struct region *parent = NULL;
+	struct region **link = root;
+	while (*link) {
+		parent = *link;
+		link = &REGION2NODE(parent)->child[tree_less(parent, region)];
+	}
+	struct tree_node *node = REGION2NODE(region);
+	node->child[0] = NULL;
+	node->child[1] = NULL;
+	node->parent_color = (uintptr_t) parent | TREE_RED;
+	*link = region;
+
+	// a red region may not have a red parent
+	while ((parent = tree_parent(region)) && tree_is_red(parent)) {
+		// the root is black, so a red parent has a parent
+		struct region *grandparent = tree_parent(parent);
+		int side = REGION2NODE(grandparent)->child[1] == parent;
+		struct region *uncle = REGION2NODE(grandparent)->child[!side];
+
+		if (tree_is_red(uncle)) {
+			tree_set_red(parent, false);
+			tree_set_red(uncle, false);
+			tree_set_red(grandparent, true);
+			region = grandparent;
+			continue;
+		}
+		if (REGION2NODE(parent)->child[!side] == region) {
+			tree_rotate(root, parent, side);
+			region = parent;
+			parent = tree_parent(region);
+		}
+		tree_set_red(parent, false);
+		tree_set_red(grandparent, true);
+		tree_rotate(root, grandparent, !side);
+	}
+	tree_set_red(*root, false);
+}
+
+// restores the black height after a black region was taken out from
+// above `region`, which may be missing, under `parent`
+static void
+tree_remove_fixup(struct region **root,
+                  struct region *region,
+                  struct region *parent)
+{
+	while (region != *root && !tree_is_red(region)) {
+		// the sibling of a missing region is never missing
+		int side = REGION2NODE(parent)->child[1] == region;
+		struct region *sibling = REGION2NODE(parent)->child[!side];
+
+		if (tree_is_red(sibling)) {
+			tree_set_red(sibling, false);
+			tree_set_red(parent, true);
+			tree_rotate(root, parent, side);
+			sibling = REGION2NODE(parent)->child[!side];
+		}
+		struct tree_node *sibling_node = REGION2NODE(sibling);
+		if (!tree_is_red(sibling_node->child[0]) &&
+		    !tree_is_red(sibling_node->child[1])) {
+			tree_set_red(sibling, true);
+			region = parent;
+			parent = tree_parent(region);
+			continue;
+		}
+		if (!tree_is_red(sibling_node->child[!side])) {
+			tree_set_red(sibling_node->child[side], false);
+			tree_set_red(sibling, true);
+			tree_rotate(root, sibling, !side);
+			sibling = REGION2NODE(parent)->child[!side];
+			sibling_node = REGION2NODE(sibling);
+		}
+		tree_set_red(sibling, tree_is_red(parent));
+		tree_set_red(parent, false);
+		tree_set_red(sibling_node->child[!side], false);
+		tree_rotate(root, parent, side);
+		region = *root;
+	}
+	if (region) {
+		tree_set_red(region, false);
+	}
+}
+
+static void
+tree_remove(struct region **root, struct region *region)
+{
+	struct tree_node *node = REGION2NODE(region);
+	struct region *child, *parent;
+	bool black = !tree_is_red(region);
+
+	if (node->child[0] && node->child[1]) {
+		// the next region in order takes its place and color
+		struct region *next = node->child[1];
+		while (REGION2NODE(next)->child[0]) {
+			next = REGION2NODE(next)->child[0];
+		}
+		struct tree_node *next_node = REGION2NODE(next);
+		child = next_node->child[1];
+		black = !tree_is_red(next);
+		if (tree_parent(next) == region) {
+			parent = next;
+		} else {
+			parent = tree_parent(next);
+			REGION2NODE(parent)->child[0] = child;
+			if (child) {
+				tree_set_parent(child, parent);
+			}
+			next_node->child[1] = node->child[1];
+			tree_set_parent(node->child[1], next);
+		}
+		next_node->child[0] = node->child[0];
+		tree_set_parent(node->child[0], next);
+		tree_replace_child(root, tree_parent(region), region, next);
+		next_node->parent_color = node->parent_color;
+	} else {
+		child = node->child[0] ? node->child[0] : node->child[1];
+		parent = tree_parent(region);
+		if (child) {
+			tree_set_parent(child, parent);
+		}
+		tree_replace_child(root, parent, region, child);
+	}
+
+	if (black) {
+		tree_remove_fixup(root, child, parent);
+	}
+}
+
+// takes out of the tree the smallest free region that holds the size, the
+// one with the lowest address among the ones of the same size
+static struct region *
+find_region_in_tree(struct region **root, size_t size)
+{
+	struct region *best = NULL;
+	for (struct region *region = *root; region;) {
+		if (region->size >= size) {
+			best = region;
+			region = REGION2NODE(region)->child[0];
+		} else {
+			region = REGION2NODE(region)->child[1];
+		}
+	}
+	if (best) {
+		tree_remove(root, best);
+		best->free = false;
+	}
+	return best;
+}
+
+#ifdef MALLOC_DEBUG
+// like assert, which may allocate while it formats the message and the
+// tree is checked under the arena lock
+#define TREE_ASSERT(expr)                                                      \
+	do {                                                                   \
+		if (!(expr)) {                                                 \
+			tree_check_failed(#expr);                              \
+		}                                                              \
+	} while (0)
+
+static void
+tree_check_failed(const char *expr)
+{
+	const char *parts[] = { "malloc: tree check failed: ", expr, "\n" };
+	for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		if (write(STDERR_FILENO, parts[i], strlen(parts[i])) < 0) {
+			break;
+		}
+	}
+	abort();
+}
+
+// checks the order, the colors and the parent links of a subtree whose
+// regions go between `low` and `high`, returns its black height and
+// counts its regions
+static int
+tree_check(struct region *region,
+           struct region *parent,
+           struct region *low,
+           struct region *high,
+           size_t *count)
+{
+	if (!region) {
+		return 1;
+	}
+	struct tree_node *node = REGION2NODE(region);
+	TREE_ASSERT(region->free && region->size >= sizeof(struct tree_node));
+	TREE_ASSERT(tree_parent(region) == parent);
+	TREE_ASSERT(!low || tree_less(low, region));
+	TREE_ASSERT(!high || tree_less(region, high));
+	// a red region may not have a red child
+	TREE_ASSERT(!tree_is_red(region) || !tree_is_red(parent));
+	(*count)++;
 
-struct block *last_little_block = NULL;
-struct block *last_mid_block = NULL;
-struct block *last_large_block = NULL;
+	int height = tree_check(node->child[0], region, low, region, count);
+	int right = tree_check(node->child[1], region, region, high, count);
+	TREE_ASSERT(height == right);
+	return height + !tree_is_red(region);
+}
 
+// checks the tree of a list searched by best fit against its blocks: it
+// holds every free region that can hold a node, and the smallest one that
+// holds `size` is returned, as the tree has to find it
+static struct region *
+tree_check_list(struct block_list *list, size_t size)
+{
+	size_t in_tree = 0;
+	TREE_ASSERT(!tree_is_red(list->tree));
+	tree_check(list->tree, NULL, NULL, NULL, &in_tree);
 
-int amount_of_mallocs = 0;
-int amount_of_frees = 0;
-int requested_memory = 0;
-// extern int amount_of_regions = 0; tira warning
-int amount_of_regions = 0;
-int amount_of_little_blocks = 0;
-int amount_of_mid_blocks = 0;
-int amount_of_large_blocks = 0;
+	size_t free_regions = 0;
+	struct region *best = NULL;
+	for (struct block *block = list->first; block; block = block->next) {
+		struct region *region = FIRST_REGION(block);
+		for (; region; region = region_next(region)) {
+			if (!region->free ||
+			    region->size < sizeof(struct tree_node)) {
+				continue;
+			}
+			free_regions++;
+			if (region->size >= size &&
+			    (!best || tree_less(region, best))) {
+				best = region;
+			}
+		}
+	}
+	TREE_ASSERT(free_regions == in_tree);
+	return best;
+}
+#endif
 
 struct region *
-find_region_in_block_best_fit(struct block *block,
-                              size_t region_size,
-                              size_t block_size)
+find_region_in_block_first_fit(struct block *block, size_t size)
+{
+	struct block *block_act = block;
+	while (block_act) {
+		struct region *region = FIRST_REGION(block_act);
+		while (region) {
+			if (region->free && region->size >= size) {
+				region->free = false;
+				return region;
+			}
+			region = region_next(region);
+		}
+		block_act = block_act->next;
+	}
+	return NULL;
+}
+
+// first fit that goes on from the region where the last search ended,
+// wrapping around to the first block, so that the small fragments are not
+// all left at the start of the list
+static struct region *
+find_region_next_fit(struct block_list *list, size_t size)
+{
+	struct region *start = list->rover;
+	if (!start) {
+		if (!list->first) {
+			return NULL;
+		}
+		start = FIRST_REGION(list->first);
+	}
+
+	struct block *block = region_block(start);
+	struct region *region = start;
+	do {
+		if (region->free && region->size >= size) {
+			region->free = false;
+			list->rover = region;
+			return region;
+		}
+		region = region_next(region);
+		if (!region) {
+			block = block->next ? block->next : list->first;
+			region = FIRST_REGION(block);
+		}
+	} while (region != start);
+	return NULL;
+}
+
+static enum block_type
+block_type_of(struct block *block)
+{
+	if (block->size <= block_sizes[LITTLE_BLOCK]) {
+		return LITTLE_BLOCK;
+	}
+	if (block->size <= block_sizes[MID_BLOCK]) {
+		return MID_BLOCK;
+	}
+	return LARGE_BLOCK;
+}
+
+static struct block_list *
+block_list_of(struct block *block)
+{
+	return &block->arena->blocks[block_type_of(block)];
+}
+
+#ifdef TLSF
+
+// computes the first and second level lists that hold the size
+static void
+tlsf_mapping_insert(size_t size, int *fl, int *sl)
 {
-	struct region *best_region = NULL;
-	size_t best_reg_dif = block_size - region_size;
+	*fl = (int) (sizeof(unsigned long) * 8) - 1 - __builtin_clzl(size);
+	*sl = (int) (size >> (*fl - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+}
+
+// computes the first list whose regions are all big enough for the size
+static void
+tlsf_mapping_search(size_t size, int *fl, int *sl)
+{
+	int round_fl = (int) (sizeof(unsigned long) * 8) - 1 -
+	               __builtin_clzl(size);
+	size += (1UL << (round_fl - TLSF_SL_LOG2)) - 1;
+	tlsf_mapping_insert(size, fl, sl);
+}
+
+static void
+tlsf_insert_region(struct tlsf_index *index, struct region *region)
+{
+	int fl, sl;
+	tlsf_mapping_insert(region->size, &fl, &sl);
+
+	struct region *head = index->heads[fl][sl];
+	REGION2LINKS(region)->next_free = head;
+	REGION2LINKS(region)->prev_free = NULL;
+	if (head) {
+		REGION2LINKS(head)->prev_free = region;
+	}
+	index->heads[fl][sl] = region;
+
+	index->fl_bitmap |= 1UL << fl;
+	index->sl_bitmap[fl] |= 1U << sl;
+}
+
+static void
+tlsf_remove_region(struct tlsf_index *index, struct region *region)
+{
+	int fl, sl;
+	tlsf_mapping_insert(region->size, &fl, &sl);
+
+	struct free_links *links = REGION2LINKS(region);
+	if (links->next_free) {
+		REGION2LINKS(links->next_free)->prev_free = links->prev_free;
+	}
+	if (links->prev_free) {
+		REGION2LINKS(links->prev_free)->next_free = links->next_free;
+	} else {
+		index->heads[fl][sl] = links->next_free;
+		if (!index->heads[fl][sl]) {
+			index->sl_bitmap[fl] &= ~(1U << sl);
+			if (!index->sl_bitmap[fl]) {
+				index->fl_bitmap &= ~(1UL << fl);
+			}
+		}
+	}
+}
+
+// takes out of the index a free region that holds the size
+// without looking at the regions themselves
+struct region *
+find_region_in_index(struct tlsf_index *index, size_t size)
+{
+	int fl, sl;
+	tlsf_mapping_search(size, &fl, &sl);
+	if (fl >= TLSF_FL_COUNT) {
+		return NULL;
+	}
+
+	unsigned int sl_map = index->sl_bitmap[fl] & (~0U << sl);
+	if (!sl_map) {
+		uint64_t fl_map = 0;
+		if (fl + 1 < TLSF_FL_COUNT) {
+			fl_map = index->fl_bitmap & (~0UL << (fl + 1));
+		}
+		if (!fl_map) {
+			return NULL;
+		}
+		fl = __builtin_ctzl(fl_map);
+		sl_map = index->sl_bitmap[fl];
+	}
+	sl = __builtin_ctz(sl_map);
+
+	struct region *region = index->heads[fl][sl];
+	tlsf_remove_region(index, region);
+	region->free = false;
+	return region;
+}
+#endif
+
+// finds the whole pages of a free region that can be purged, leaving the
+// bytes of its links untouched, returns false if there are none
+static bool
+purgeable_pages(struct region *region, uintptr_t *start, uintptr_t *end)
+{
+	// a block backed by huge pages only gives back whole ones,
+	// so that the ones still in use are not split
+	uintptr_t page_size = region_block(region)->pages == PAGES_BASE
+	                              ? (uintptr_t) getpagesize()
+	                              : HUGE_PAGE_SIZE;
+	uintptr_t payload = (uintptr_t) REGION2PTR(region) + FREE_REGION_LINKS_SIZE;
+	*start = ALIGN_UP(payload, page_size);
+	*end = ((uintptr_t) REGION2PTR(region) + region->size) & ~(page_size - 1);
+	return *start < *end;
+}
+
+// appends a free region to the dirty list of its arena, if it has whole
+// pages that were not purged
+static void
+dirty_insert(struct arena *arena, struct region *region)
+{
+	uintptr_t start, end;
+	if (region->purged || !purgeable_pages(region, &start, &end)) {
+		return;
+	}
+
+	struct dirty_links *links = REGION2DIRTY(region);
+	links->next = NULL;
+	links->prev = arena->dirty_last;
+	if (arena->dirty_last) {
+		REGION2DIRTY(arena->dirty_last)->next = region;
+	} else {
+		arena->dirty_first = region;
+	}
+	arena->dirty_last = region;
+	arena->dirty_bytes += end - start;
+}
+
+// removes a free region from the dirty list of its arena, if it is there
+static void
+dirty_remove(struct arena *arena, struct region *region)
+{
+	uintptr_t start, end;
+	if (region->purged || !purgeable_pages(region, &start, &end)) {
+		return;
+	}
+
+	struct dirty_links *links = REGION2DIRTY(region);
+	if (links->prev) {
+		REGION2DIRTY(links->prev)->next = links->next;
+	} else {
+		arena->dirty_first = links->next;
+	}
+	if (links->next) {
+		REGION2DIRTY(links->next)->prev = links->prev;
+	} else {
+		arena->dirty_last = links->prev;
+	}
+	arena->dirty_bytes -= end - start;
+}
+
+// adds a free region to the index of the policy of its block type, if it
+// has one, and to the dirty list of its arena
+// regions too small to hold a tree node are left out of the tree, they are
+// only reused once they are joined with a neighbour
+static void
+insert_free_region(struct region *region)
+{
+	struct block *block = region_block(region);
+	enum block_type type = block_type_of(block);
+	struct block_list *list = &block->arena->blocks[type];
+
+	switch (fit_policies[type]) {
+	case FIT_BEST:
+		if (region->size >= sizeof(struct tree_node)) {
+			tree_insert(&list->tree, region);
+		}
+		break;
+#ifdef TLSF
+	case FIT_TLSF:
+		tlsf_insert_region(&list->index, region);
+		break;
+#endif
+	default:
+		break;
+	}
+	dirty_insert(block->arena, region);
+}
+
+// removes a free region from the index and the list it was added to,
+// with the same size and purged flag
+static void
+remove_free_region(struct region *region)
+{
+	struct block *block = region_block(region);
+	enum block_type type = block_type_of(block);
+	struct block_list *list = &block->arena->blocks[type];
+
+	switch (fit_policies[type]) {
+	case FIT_BEST:
+		if (region->size >= sizeof(struct tree_node)) {
+			tree_remove(&list->tree, region);
+		}
+		break;
+#ifdef TLSF
+	case FIT_TLSF:
+		tlsf_remove_region(&list->index, region);
+		break;
+#endif
+	default:
+		break;
+	}
+	dirty_remove(block->arena, region);
+}
+
+// finds the next free region
+// that holds the requested size
+//
+// the search starts in the smallest type of block that can hold it
+static struct region *
+find_free_region(struct arena *arena, size_t size)
+{
+	struct region *region = NULL;
+#ifdef MALLOC_DEBUG
+	struct region *best_fit;
+#endif
+
+	for (int type = 0; type < BLOCK_TYPES && !region; type++) {
+		if (size >= block_sizes[type]) {
+			continue;
+		}
+		struct block_list *list = &arena->blocks[type];
+		switch (fit_policies[type]) {
+		case FIT_FIRST:
+		case FIT_ADDRESS:
+			// the blocks of an address ordered list are sorted,
+			// so the first region that fits has the lowest address
+			region = find_region_in_block_first_fit(list->first, size);
+			break;
+		case FIT_NEXT:
+			region = find_region_next_fit(list, size);
+			break;
+		case FIT_BEST:
+#ifdef MALLOC_DEBUG
+			best_fit = tree_check_list(list, size);
+#endif
+			// the region is already out of the index
+			region = find_region_in_tree(&list->tree, size);
+#ifdef MALLOC_DEBUG
+			TREE_ASSERT(region == best_fit);
+#endif
+			if (region) {
+				dirty_remove(arena, region);
+			}
+			continue;
+#ifdef TLSF
+		case FIT_TLSF:
+			// the region is already out of the index
+			region = find_region_in_index(&list->index, size);
+			if (region) {
+				dirty_remove(arena, region);
+			}
+			continue;
+#endif
+		default:
+			break;
+		}
+		if (region) {
+			remove_free_region(region);
+		}
+	}
+
+	return region;
+}
+
+// cuts a region after `size` bytes, returns the free tail that is left,
+// which is not added to the free region index
+static struct region *
+carve_region(struct region *region, size_t size)
+{
+	struct region *new_region = (void *) region + sizeof(struct region) + size;
+	new_region->free = true;
+	new_region->size = region->size - size - sizeof(struct region);
+	new_region->last = region->last;
+	set_region_prev(new_region, region);
+	set_region_block(new_region, region_block(region));
+	new_region->magic_number = MAGIC_NUMBER;
+	new_region->sampled = false;
+	// the pages of the tail are as old as the ones of the region
+	new_region->purged = region->purged;
+	new_region->zeroed = region->zeroed;
+	struct region *next = region_next(new_region);
+	if (next) {
+		set_region_prev(next, new_region);
+	}
+	region->last = false;
+	region->size = size;
+
+	region_block(region)->arena->amount_of_regions++;
+
+	return new_region;
+}
+
+void
+split_region(struct region *region, size_t size)
+{
+	insert_free_region(carve_region(region, size));
+}
+
+// appends the region that follows to the given one,
+// none of them may be in the free region index
+static void
+join_next_region(struct region *region)
+{
+	struct region *next = region_next(region);
+	struct block_list *list = block_list_of(region_block(region));
+	if (list->rover == next) {
+		list->rover = region;
+	}
+	region->size = region->size + next->size + sizeof(struct region);
+	// the header of the next region is now part of the payload
+	region->zeroed = false;
+	region->last = next->last;
+	next = region_next(region);
+	if (next) {
+		set_region_prev(next, region);
+	}
+	region_block(region)->arena->amount_of_regions--;
+}
+
+struct region *
+create_region_in_new_block(struct block *block)
+{
+	block->arena->amount_of_regions++;
+
+	struct region *new_region = FIRST_REGION(block);
+	new_region->free = false;
+	new_region->purged = false;
+	new_region->zeroed = false;
+	new_region->sampled = false;
+	new_region->size =
+	        block->size - sizeof(struct block) - sizeof(struct region);
+	new_region->last = true;
+	new_region->prev_offset = 0;
+	set_region_block(new_region, block);
+	new_region->magic_number = MAGIC_NUMBER;
+
+	return new_region;
+}
+//
+// rounds a size up to a multiple of the page size
+static size_t
+page_round(size_t size)
+{
+	size_t page_size = getpagesize();
+	return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// accounts the bytes mapped (or unmapped, if negative) for the heap
+static void
+count_mapped(ssize_t bytes)
+{
+	size_t mapped =
+	        __atomic_add_fetch(&mapped_bytes, bytes, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+	while (mapped > peak &&
+	       !__atomic_compare_exchange_n(&mapped_peak,
+	                                    &peak,
+	                                    mapped,
+	                                    true,
+	                                    __ATOMIC_RELAXED,
+	                                    __ATOMIC_RELAXED))
+		;
+}
+
+// milliseconds since an arbitrary point, only used to measure intervals
+static uint64_t
+now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// nanoseconds since an arbitrary point, precise enough to order events
+static uint64_t
+now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// unmaps the `count` oldest empty blocks of a list
+static void
+release_empty_blocks(struct arena *arena, struct block_list *list, int count)
+{
+	for (int i = 0; i < count; i++) {
+		struct block *block = list->empty_blocks[i];
+		arena->empty_bytes -= block->size;
+		count_mapped(-(ssize_t) block->size);
+		munmap(block, block->size);
+	}
+	list->amount_of_empty_blocks -= count;
+	memmove(list->empty_blocks,
+	        list->empty_blocks + count,
+	        list->amount_of_empty_blocks * sizeof(struct block *));
+	memmove(list->empty_since,
+	        list->empty_since + count,
+	        list->amount_of_empty_blocks * sizeof(uint64_t));
+}
+
+// unmaps the empty blocks that were not reused for BLOCK_CACHE_DECAY_MS
+static void
+decay_empty_blocks(struct arena *arena, uint64_t now)
+{
+	for (int type = 0; type < BLOCK_TYPES; type++) {
+		struct block_list *list = &arena->blocks[type];
+		int expired = 0;
+		while (expired < list->amount_of_empty_blocks &&
+		       now - list->empty_since[expired] >= BLOCK_CACHE_DECAY_MS) {
+			expired++;
+		}
+		if (expired) {
+			release_empty_blocks(arena, list, expired);
+		}
+	}
+}
+
+// unmaps the cached huge mappings that were not reused for
+// BLOCK_CACHE_DECAY_MS, or all of them if `all` is set
+static void
+decay_huge_cache(uint64_t now, bool all)
+{
+	struct block *expired[HUGE_CACHE_SIZE];
+	int count = 0;
+
+	pthread_mutex_lock(&huge_lock);
+	for (int i = 0; i < HUGE_CACHE_SIZE; i++) {
+		if (huge_cache[i] &&
+		    (all || now - huge_cache_since[i] >= BLOCK_CACHE_DECAY_MS)) {
+			expired[count++] = huge_cache[i];
+			huge_cache[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&huge_lock);
+
+	// the header page of a cached mapping is never purged
+	for (int i = 0; i < count; i++) {
+		count_mapped(-(ssize_t) expired[i]->size);
+		munmap(expired[i], expired[i]->size);
+	}
+}
+
+// gives back pages to the kernel, returns the advice that was used
+// or -1 if they could not be given back
+static int
+advise_pages(void *start, size_t len, enum block_pages pages)
+{
+	// MADV_FREE is not supported by every kernel, nor by hugetlb pages
+	int advice = pages == PAGES_HUGETLB
+	                     ? MADV_DONTNEED
+	                     : __atomic_load_n(&purge_advice, __ATOMIC_RELAXED);
+	// pages locked by malloc_reserve can not be purged with either one
+	int failed = madvise(start, len, advice);
+	if (failed && advice != MADV_DONTNEED) {
+		advice = MADV_DONTNEED;
+		failed = madvise(start, len, advice);
+		if (!failed) {
+			__atomic_store_n(&purge_advice,
+			                 advice,
+			                 __ATOMIC_RELAXED);
+		}
+	}
+	return failed ? -1 : advice;
+}
+
+// gives back to the kernel the whole pages of a free region, leaving
+// the bytes used by its links untouched, returns the bytes given back
+static size_t
+purge_region(struct region *region)
+{
+	uintptr_t payload = (uintptr_t) REGION2PTR(region) + FREE_REGION_LINKS_SIZE;
+	uintptr_t payload_end = (uintptr_t) REGION2PTR(region) + region->size;
+	uintptr_t start, end;
+	if (!purgeable_pages(region, &start, &end)) {
+		return 0;
+	}
+
+	int advice = advise_pages((void *) start,
+	                          end - start,
+	                          region_block(region)->pages);
+	if (advice < 0) {
+		return 0;
+	}
+
+	// pages dropped with MADV_DONTNEED come back zeroed, so clearing
+	// the bytes around them is enough to know the region is zero
+	if (advice == MADV_DONTNEED) {
+		memset((void *) payload, 0, start - payload);
+		memset((void *) end, 0, payload_end - end);
+		region->zeroed = true;
+	}
+	return end - start;
+}
+
+// purges the oldest free regions of an arena while that leaves at least
+// `limit` bytes of dirty pages
+static void
+purge_arena(struct arena *arena, size_t limit)
+{
+	while (arena->dirty_first) {
+		struct region *region = arena->dirty_first;
+		uintptr_t start, end;
+		purgeable_pages(region, &start, &end);
+		if (arena->dirty_bytes - (end - start) < limit) {
+			break;
+		}
+		dirty_remove(arena, region);
+		arena->purged_bytes += purge_region(region);
+		region->purged = true;
+	}
+}
+
+// bytes of dirty pages an arena may keep: the ones made dirty in each
+// epoch decay along a smoothstep curve, from all of them to none after
+// PURGE_DECAY_STEPS epochs
+static size_t
+decay_limit(struct arena *arena)
+{
+	const uint64_t steps = PURGE_DECAY_STEPS;
+	const uint64_t scale = steps * steps * steps;
+	size_t limit = 0;
+	for (uint64_t age = 1; age <= steps; age++) {
+		// 1 - smoothstep(age / steps), scaled by steps^3, the bytes
+		// fit in the address space so the product does not overflow
+		uint64_t share = scale - age * age * (3 * steps - 2 * age);
+		limit += arena->dirty_backlog[age - 1] * share / scale;
+	}
+	return limit;
+}
+
+// keeps an empty block to be reused, replacing the oldest one of its type
+// if there are too many, returns false if it has to be unmapped instead
+static bool
+cache_empty_block(struct block *block)
+{
+	struct arena *arena = block->arena;
+	enum block_type type = block_type_of(block);
+	struct block_list *list = &arena->blocks[type];
+	uint64_t now = now_ms();
+
+	// blocks grown by realloc do not have the size of their type
+	if (block->size != block_sizes[type] ||
+	    arena->empty_bytes + block->size > BLOCK_CACHE_MAX_BYTES) {
+		return false;
+	}
+	if (list->amount_of_empty_blocks == max_empty_blocks[type]) {
+		release_empty_blocks(arena, list, 1);
+	}
+
+	list->empty_blocks[list->amount_of_empty_blocks] = block;
+	list->empty_since[list->amount_of_empty_blocks] = now;
+	list->amount_of_empty_blocks++;
+	arena->empty_bytes += block->size;
+	return true;
+}
+
+// takes the most recently cached empty block of a type, if any
+static struct block *
+reuse_empty_block(struct arena *arena, enum block_type type)
+{
+	struct block_list *list = &arena->blocks[type];
+
+	if (!list->amount_of_empty_blocks) {
+		return NULL;
+	}
+
+	list->amount_of_empty_blocks--;
+	struct block *block = list->empty_blocks[list->amount_of_empty_blocks];
+	arena->empty_bytes -= block->size;
+	return block;
+}
+
+// links a block at the end of its list, or in address order if the list
+// is searched with address ordered first fit
+static void
+link_block(struct block_list *list, struct block *block, enum block_type type)
+{
+	struct block *next = NULL;
+	if (fit_policies[type] == FIT_ADDRESS) {
+		next = list->first;
+		while (next && next < block) {
+			next = next->next;
+		}
+	}
+
+	block->next = next;
+	block->previous = next ? next->previous : list->last;
+	if (block->previous) {
+		block->previous->next = block;
+	} else {
+		list->first = block;
+	}
+	if (next) {
+		next->previous = block;
+	} else {
+		list->last = block;
+	}
+}
+
+static void
+unlink_block(struct block_list *list, struct block *block)
+{
+	if (block->previous) {
+		block->previous->next = block->next;
+	} else {
+		list->first = block->next;
+	}
+	if (block->next) {
+		block->next->previous = block->previous;
+	} else {
+		list->last = block->previous;
+	}
+}
+
+// node of the cpu the calling thread runs on
+static unsigned int
+thread_node(void)
+{
+	unsigned int cpu, id;
+	if (!numa_bind || getcpu(&cpu, &id) != 0) {
+		return 0;
+	}
+	for (unsigned int node = 0; node < amount_of_nodes; node++) {
+		if (node_ids[node] == id) {
+			return node;
+		}
+	}
+	return 0;
+}
+
+// takes the pages of a mapping from a node when they are touched, or from
+// another one if it runs out of memory, nothing is done with a single node
+static void
+bind_to_node(void *start, size_t size, unsigned int node)
+{
+	if (!numa_bind) {
+		return;
+	}
+	unsigned long mask = 1UL << node_ids[node];
+	// the mapping is still usable if it fails, only its pages may be remote
+	syscall(SYS_mbind,
+	        start,
+	        size,
+	        MPOL_PREFERRED,
+	        &mask,
+	        sizeof(mask) * CHAR_BIT,
+	        0);
+}
+
+// maps a block of a type, backed by huge pages if they are enabled: from
+// the reserved ones with MAP_HUGETLB, or aligned to a huge page and with
+// MADV_HUGEPAGE, so that the kernel backs it with transparent ones
+static struct block *
+map_block(enum block_type type, enum block_pages *pages)
+{
+	size_t size = block_sizes[type];
+	*pages = PAGES_BASE;
+	if (huge_pages == HUGE_PAGES_NONE || type == LITTLE_BLOCK) {
+		return mmap(NULL,
+		            size,
+		            PROT_WRITE | PROT_READ,
+		            MAP_ANONYMOUS | MAP_PRIVATE,
+		            0,
+		            0);
+	}
+
+#ifdef MAP_HUGETLB
+	if (huge_pages == HUGE_PAGES_HUGETLB &&
+	    !__atomic_load_n(&hugetlb_failed, __ATOMIC_RELAXED)) {
+		int flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+		flags |= MAP_HUGE_2MB;
+#endif
+		void *block = mmap(NULL, size, PROT_WRITE | PROT_READ, flags, -1, 0);
+		if (block != MAP_FAILED) {
+			*pages = PAGES_HUGETLB;
+			return block;
+		}
+		// there are no reserved huge pages left
+		__atomic_store_n(&hugetlb_failed, true, __ATOMIC_RELAXED);
+	}
+#endif
+
+	// the pages around the first aligned huge page are unmapped
+	char *map = mmap(NULL,
+	                 size + HUGE_PAGE_SIZE,
+	                 PROT_WRITE | PROT_READ,
+	                 MAP_ANONYMOUS | MAP_PRIVATE,
+	                 0,
+	                 0);
+	if (map == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	char *block = (char *) ALIGN_UP((uintptr_t) map, HUGE_PAGE_SIZE);
+	if (block > map) {
+		munmap(map, block - map);
+	}
+	munmap(block + size, map + HUGE_PAGE_SIZE - block);
+	// the block stays aligned even if the kernel does not have them
+	madvise(block, size, MADV_HUGEPAGE);
+	*pages = PAGES_THP;
+	return (struct block *) block;
+}
+
+// faults in the pages of a mapping now, instead of on their first use
+static void
+prefault_pages(void *start, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(start, size, MADV_POPULATE_WRITE)) {
+		return;
+	}
+#endif
+	// older kernels do not have it, a write to each page does the same
+	size_t page_size = getpagesize();
+	for (size_t offset = 0; offset < size; offset += page_size) {
+		((volatile char *) start)[offset] = 0;
+	}
+}
+
+// maps `count` blocks of a type for a node and keeps them reserved,
+// returns 0 or the error of the first mapping or mlock that failed
+static int
+reserve_blocks(unsigned int node, enum block_type type, size_t count, int flags)
+{
+	size_t block_size = block_sizes[type];
+	int error = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		enum block_pages pages;
+		struct block *block = map_block(type, &pages);
+		if (block == MAP_FAILED) {
+			return ENOMEM;
+		}
+		// the pages are taken from the node as they are touched
+		bind_to_node(block, block_size, node);
+
+		// mlock also faults the pages in, the block is kept even if
+		// they can not be locked
+		bool locked = false;
+		if (flags & MALLOC_RESERVE_MLOCK) {
+			locked = !mlock(block, block_size);
+			if (!locked && !error) {
+				error = errno;
+			}
+		}
+		if (!locked && (flags & MALLOC_RESERVE_PREFAULT)) {
+			prefault_pages(block, block_size);
+		}
+
+		count_mapped(block_size);
+		block->pages = pages;
+		block->size = block_size;
+		block->arena = NULL;
+
+		pthread_mutex_lock(&reserve_lock);
+		block->next = reserved_blocks[node][type];
+		__atomic_store_n(&reserved_blocks[node][type],
+		                 block,
+		                 __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&reserve_lock);
+	}
+	return error;
+}
+
+// takes a reserved block of a type for a node, if any
+static struct block *
+take_reserved_block(unsigned int node, enum block_type type)
+{
+	if (!__atomic_load_n(&reserved_blocks[node][type], __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&reserve_lock);
+	struct block *block = reserved_blocks[node][type];
+	if (block) {
+		__atomic_store_n(&reserved_blocks[node][type],
+		                 block->next,
+		                 __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&reserve_lock);
+	return block;
+}
+
+struct region *
+create_block_with_size(struct arena *arena, enum block_type type)
+{
+	size_t block_size = block_sizes[type];
+	struct block_list *list = &arena->blocks[type];
+	struct block *new_block = reuse_empty_block(arena, type);
+	// new mappings, and the reserved ones, are zero filled
+	bool zeroed = !new_block;
+	enum block_pages pages = PAGES_BASE;
+
+	if (!new_block) {
+		new_block = take_reserved_block(arena->node, type);
+	}
+	if (!new_block) {
+		new_block = map_block(type, &pages);
+		if (new_block == MAP_FAILED) {
+			print_error("ERROR: map failed");
+			return NULL;
+		}
+		// before the header touches the first page
+		bind_to_node(new_block, block_size, arena->node);
+		count_mapped(block_size);
+		new_block->pages = pages;
+	}
+
+	list->amount_of_blocks++;
+
+	new_block->size = block_size;
+	new_block->arena = arena;
+	link_block(list, new_block, type);
+
+	struct region *new_region = create_region_in_new_block(new_block);
+	new_region->zeroed = zeroed;
+
+	return new_region;
+}
+
+struct region *
+create_block(struct arena *arena, size_t region_size)
+{
+	// the block must also hold its own header and the region header
+	size_t needed =
+	        region_size + sizeof(struct block) + sizeof(struct region);
+
+	for (int type = 0; type < BLOCK_TYPES; type++) {
+		if (needed <= block_sizes[type] &&
+		    arena->blocks[type].amount_of_blocks < max_blocks[type]) {
+			return create_block_with_size(arena, type);
+		}
+	}
+	// the request is served by a huge region instead
+	return NULL;
+}
+
+// gets a region of the given size from the blocks of the arena
+// the arena lock must be held
+static struct region *
+allocate_region(struct arena *arena, size_t size)
+{
+	// find available regions
+	struct region *new_region = find_free_region(arena, size);
+
+	// should be created a new block
+	if (!new_region) {
+		new_region = create_block(arena, size);
+		if (!new_region) {
+			return NULL;
+		}
+	}
+
+	// verify splitting
+	if (new_region->size - size >= sizeof(struct region) + min_size_region) {
+		split_region(new_region, size);
+	}
+
+	// the pages of an allocated region are dirty from now on
+	new_region->purged = false;
+
+	return new_region;
+}
+
+// gets up to `n` regions of the given size cut one after the other from a
+// free region or a new block that holds all of them, or as many as it can,
+// so that the search is done once per run instead of once per region
+// returns how many payloads were stored in `ptrs`,
+// the arena lock must be held
+static size_t
+allocate_region_run(struct arena *arena, size_t size, size_t n, void **ptrs)
+{
+	// a run is at most as long as the biggest block can hold
+	size_t stride = size + sizeof(struct region);
+	size_t fits = (block_sizes[LARGE_BLOCK] - sizeof(struct block)) / stride;
+	if (n > fits) {
+		n = fits;
+	}
+	size_t wanted = n * stride - sizeof(struct region);
+	struct region *region = find_free_region(arena, wanted);
+	if (!region) {
+		region = create_block(arena, wanted);
+	}
+	if (!region) {
+		region = allocate_region(arena, size);
+		if (!region) {
+			return 0;
+		}
+	}
+
+	size_t done = 0;
+	for (;;) {
+		struct region *rest = NULL;
+		if (region->size - size >= sizeof(struct region) + min_size_region) {
+			rest = carve_region(region, size);
+		}
+		region->purged = false;
+		ptrs[done++] = REGION2PTR(region);
+		if (!rest) {
+			break;
+		}
+		if (done == n || rest->size < size) {
+			insert_free_region(rest);
+			break;
+		}
+		rest->free = false;
+		region = rest;
+	}
+	return done;
+}
+
+void
+delete_block(struct block *block)
+{
+	struct block_list *list = block_list_of(block);
+	unlink_block(list, block);
+	if (list->rover && region_block(list->rover) == block) {
+		list->rover = NULL;
+	}
+
+	// testing
+	block->arena->amount_of_regions--;
+	list->amount_of_blocks--;
+	if (!cache_empty_block(block)) {
+		count_mapped(-(ssize_t) block->size);
+		munmap(block, block->size);
+	}
+}
+
+
+// gives back a region to its block, coalescing it with its neighbours
+// the lock of the arena that owns the block must be held
+static void
+free_region(struct region *curr)
+{
+	assert(curr->free == 0);
+	curr->free = true;
+
+	// check if next region is free
+	struct region *next = region_next(curr);
+
+	if (next && next->free) {
+		remove_free_region(next);
+		join_next_region(curr);
+	}
+	// check if previous region is free
+	struct region *prev = region_prev(curr);
+
+	if (prev && prev->free) {
+		remove_free_region(prev);
+		join_next_region(prev);
+		prev->purged = false;
+
+		if (!prev->prev_offset && prev->last) {
+			delete_block(region_block(prev));
+		} else {
+			insert_free_region(prev);
+		}
+
+	} else if (!curr->prev_offset && curr->last) {
+		delete_block(region_block(curr));
+	} else {
+		insert_free_region(curr);
+	}
+}
+
+// resizes an allocated region without moving it, using the free region
+// that follows it when growing and giving back the tail when shrinking
+// returns false if the region can not hold `size` bytes in place
+// the lock of the arena that owns the block must be held
+static bool
+resize_region(struct region *curr, size_t size)
+{
+	struct region *next = region_next(curr);
+
+	if (curr->size < size) {
+		if (!next || !next->free ||
+		    curr->size + sizeof(struct region) + next->size < size) {
+			return false;
+		}
+		remove_free_region(next);
+		join_next_region(curr);
+		next = region_next(curr);
+	} else if (next && next->free) {
+		// the tail is joined with the free region that follows it
+		remove_free_region(next);
+		join_next_region(curr);
+		next = region_next(curr);
+	}
+
+	if (curr->size >= size + sizeof(struct region) + min_size_region) {
+		split_region(curr, size);
+	}
+	return true;
+}
+
+// moves the payload of a region allocated with room for a leading region
+// up to the next `alignment` boundary: the bytes before it are freed
+// as a region of their own, and the ones after `size` go back as well
+// the arena lock must be held
+static struct region *
+align_region(struct region *region, size_t alignment, size_t size)
+{
+	uintptr_t payload = (uintptr_t) REGION2PTR(region);
+
+	if (payload % alignment) {
+		uintptr_t aligned = ALIGN_UP(
+		        payload + sizeof(struct region) + min_size_region, alignment);
+		split_region(region, aligned - payload - sizeof(struct region));
+
+		struct region *aligned_region = region_next(region);
+		remove_free_region(aligned_region);
+		aligned_region->free = false;
+		free_region(region);
+		region = aligned_region;
+	}
+
+	// the tail is joined with the free region that may follow it
+	resize_region(region, size);
+	return region;
+}
+
+// grows the only allocated region of a large block by remapping the
+// whole block, so that its pages are moved by the kernel, not copied
+// returns the region at its new address, or NULL if mremap fails
+// the lock of the arena that owns the block must be held
+static struct region *
+remap_region(struct region *curr, size_t size)
+{
+	struct block *block = region_block(curr);
+	struct block_list *list = block_list_of(block);
+	size_t block_size =
+	        page_round(size + sizeof(struct block) + sizeof(struct region));
+	if (block_size > REGION_MAX_OFFSET) {
+		return NULL;
+	}
+
+	// the free index must not point inside the block while it moves
+	if (!curr->last) {
+		remove_free_region(region_next(curr));
+		join_next_region(curr);
+	}
+	if (list->rover && region_block(list->rover) == block) {
+		list->rover = NULL;
+	}
+
+	size_t old_size = block->size;
+	block = mremap(block, old_size, block_size, MREMAP_MAYMOVE);
+	if (block == MAP_FAILED) {
+		return NULL;
+	}
+	block->size = block_size;
+	count_mapped((ssize_t) block_size - (ssize_t) old_size);
+
+	if (block->previous) {
+		block->previous->next = block;
+	} else {
+		list->first = block;
+	}
+	if (block->next) {
+		block->next->previous = block;
+	} else {
+		list->last = block;
+	}
+	// the block may have moved past its neighbours
+	if (fit_policies[LARGE_BLOCK] == FIT_ADDRESS) {
+		unlink_block(list, block);
+		link_block(list, block, LARGE_BLOCK);
+	}
+
+	curr = FIRST_REGION(block);
+	curr->size = block_size - sizeof(struct block) - sizeof(struct region);
+	if (curr->size >= size + sizeof(struct region) + min_size_region) {
+		split_region(curr, size);
+	}
+	return curr;
+}
+
+// a region can be remapped when it is the only allocated one of a large block
+// that is not made of hugetlb pages, which mremap can not resize
+static bool
+is_remappable(struct region *curr)
+{
+	struct region *next = region_next(curr);
+	return block_type_of(region_block(curr)) == LARGE_BLOCK &&
+	       region_block(curr)->pages != PAGES_HUGETLB &&
+	       !curr->prev_offset && (!next || (next->free && next->last));
+}
+
+static void
+slab_zone_init(void)
+{
+	// only address space is reserved, slabs are enabled as they are used
+	char *zone = mmap(NULL,
+	                  SLAB_ZONE_SIZE + SLAB_SIZE,
+	                  PROT_NONE,
+	                  MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+	                  -1,
+	                  0);
+	if (zone == MAP_FAILED) {
+		return;
+	}
+
+	// slabs are aligned to their size to find them from their objects
+	slab_zone = (char *) (((uintptr_t) zone + SLAB_SIZE - 1) &
+	                      ~((uintptr_t) SLAB_SIZE - 1));
+}
+
+// tells if a pointer belongs to a slab only by its address
+static bool
+is_slab_object(void *ptr)
+{
+	return slab_zone && (char *) ptr >= slab_zone &&
+	       (char *) ptr < slab_zone + SLAB_ZONE_SIZE;
+}
+
+static void
+slab_link(struct slab *slab)
+{
+	struct slab **list = &slab->arena->slabs[slab->size_class];
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list) {
+		(*list)->prev = slab;
+	}
+	*list = slab;
+}
+
+static void
+slab_unlink(struct slab *slab)
+{
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		slab->arena->slabs[slab->size_class] = slab->next;
+	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+// takes a slab from the zone for the size class
+// the arena lock must be held
+static struct slab *
+slab_create(struct arena *arena, int size_class)
+{
+	pthread_once(&slab_zone_once, slab_zone_init);
+	if (!slab_zone) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&slab_zone_lock);
+	struct slab *slab = free_slabs;
+	if (slab) {
+		free_slabs = slab->next;
+	} else if (slab_zone_used < SLAB_ZONE_SIZE) {
+		slab = (struct slab *) (slab_zone + slab_zone_used);
+		if (mprotect(slab, SLAB_SIZE, PROT_READ | PROT_WRITE) == 0) {
+			slab_zone_used += SLAB_SIZE;
+			count_mapped(SLAB_SIZE);
+		} else {
+			slab = NULL;
+		}
+	}
+	pthread_mutex_unlock(&slab_zone_lock);
+
+	if (!slab) {
+		return NULL;
+	}
+
+	slab->arena = arena;
+	slab->size_class = size_class;
+	slab->free_objects = NULL;
+	slab->next_unused = SLAB_HEADER_SIZE;
+	slab->used = 0;
+	slab->capacity =
+	        (SLAB_SIZE - SLAB_HEADER_SIZE) / SLAB_CLASS_SIZE(size_class);
+	slab_link(slab);
+	arena->amount_of_slabs++;
+
+	return slab;
+}
+
+// gives back an empty slab to the zone, releasing its pages
+// the arena lock must be held
+static void
+slab_delete(struct slab *slab)
+{
+	slab_unlink(slab);
+	madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+
+	pthread_mutex_lock(&slab_zone_lock);
+	slab->next = free_slabs;
+	free_slabs = slab;
+	pthread_mutex_unlock(&slab_zone_lock);
+}
+
+// keeps an empty slab in its list if the arena has no other empty one of
+// its size class, so that a single object allocated and freed over and
+// over does not take a slab from the zone every time, or gives it back
+// the arena lock must be held
+static void
+slab_empty(struct slab *slab)
+{
+	struct arena *arena = slab->arena;
+	arena->amount_of_slabs--;
+	if (arena->empty_slabs[slab->size_class]) {
+		slab_delete(slab);
+		return;
+	}
+	arena->empty_slabs[slab->size_class] = slab;
+	arena->empty_slab_since[slab->size_class] = now_ms();
+	arena->amount_of_empty_slabs++;
+}
+
+// gives back to the zone the empty slabs that were not reused for
+// BLOCK_CACHE_DECAY_MS, or all of them if `all` is set
+// the arena lock must be held
+static void
+decay_empty_slabs(struct arena *arena, uint64_t now, bool all)
+{
+	for (int i = 0; i < SLAB_CLASSES && arena->amount_of_empty_slabs; i++) {
+		struct slab *slab = arena->empty_slabs[i];
+		if (slab &&
+		    (all || now - arena->empty_slab_since[i] >=
+		                    BLOCK_CACHE_DECAY_MS)) {
+			arena->empty_slabs[i] = NULL;
+			arena->amount_of_empty_slabs--;
+			slab_delete(slab);
+		}
+	}
+}
+
+// gets an object of the size class from the slabs of the arena
+// the arena lock must be held
+static void *
+slab_alloc(struct arena *arena, int size_class)
+{
+	struct slab *slab = arena->slabs[size_class];
+	if (!slab) {
+		slab = slab_create(arena, size_class);
+		if (!slab) {
+			return NULL;
+		}
+	}
+	if (slab == arena->empty_slabs[size_class]) {
+		arena->empty_slabs[size_class] = NULL;
+		arena->amount_of_empty_slabs--;
+		arena->amount_of_slabs++;
+	}
+
+	void *object;
+	if (slab->free_objects) {
+		object = slab->free_objects;
+		slab->free_objects = *(void **) object;
+	} else {
+		object = (char *) slab + slab->next_unused;
+		slab->next_unused += SLAB_CLASS_SIZE(size_class);
+	}
+	slab->used++;
+
+	// full slabs leave the list until one of their objects is freed
+	if (slab->used == slab->capacity) {
+		slab_unlink(slab);
+	}
+
+	return object;
+}
+
+// the lock of the arena that owns the slab must be held
+static void
+slab_free(void *object)
+{
+	struct slab *slab = PTR2SLAB(object);
+
+	if (slab->used == slab->capacity) {
+		slab_link(slab);
+	}
+	*(void **) object = slab->free_objects;
+	slab->free_objects = object;
+	slab->used--;
+
+	if (!slab->used) {
+		slab_empty(slab);
+	}
+}
+
+// unmaps the expired empty blocks of an arena and, at the end of every
+// decay epoch, purges its oldest free regions down to the decay curve and
+// gives back the expired empty slabs and huge mappings
+// the arena lock must be held
+static void
+arena_decay(struct arena *arena, uint64_t now)
+{
+	decay_empty_blocks(arena, now);
+
+	uint64_t epoch = purge_decay_ms / PURGE_DECAY_STEPS;
+	if (purge_decay_ms < 0 || now - arena->last_purge < epoch) {
+		return;
+	}
+	decay_empty_slabs(arena, now, false);
+	decay_huge_cache(now, false);
+	uint64_t epochs = PURGE_DECAY_STEPS;
+	if (epoch) {
+		epochs = (now - arena->last_purge) / epoch;
+		arena->last_purge += epochs * epoch;
+	}
+
+	// the bytes made dirty since the last pass are taken as made dirty
+	// in the last epoch, the arena may have been idle for a while
+	size_t *backlog = arena->dirty_backlog;
+	size_t shift = epochs < PURGE_DECAY_STEPS ? epochs : PURGE_DECAY_STEPS;
+	memmove(backlog + shift,
+	        backlog,
+	        (PURGE_DECAY_STEPS - shift) * sizeof(size_t));
+	memset(backlog, 0, shift * sizeof(size_t));
+	if (epoch) {
+		backlog[0] = arena->dirty_bytes > arena->decay_dirty
+		                     ? arena->dirty_bytes - arena->decay_dirty
+		                     : 0;
+	}
+
+	purge_arena(arena, decay_limit(arena));
+	arena->decay_dirty = arena->dirty_bytes;
+}
+
+// purges every dirty page of an arena and gives back its empty slabs
+// right away
+// the arena lock must be held
+static void
+arena_purge(struct arena *arena)
+{
+	decay_empty_slabs(arena, 0, true);
+	purge_arena(arena, 0);
+	memset(arena->dirty_backlog, 0, sizeof(arena->dirty_backlog));
+	arena->decay_dirty = 0;
+}
+
+// does the time based work of an arena from the locked paths of malloc
+// and free, unless there is a background thread doing it
+static void
+arena_tick(struct arena *arena)
+{
+	if (!background_purge) {
+		arena_decay(arena, now_ms());
+	}
+}
+
+// a huge mapping starts at the page of its block header, which is not the
+// first page that was mapped when the region had to be aligned
+static struct block *
+huge_base(struct block *block)
+{
+	return (struct block *) ((uintptr_t) block &
+	                         ~((uintptr_t) getpagesize() - 1));
+}
+
+// sets up the only region of a huge mapping
+static struct region *
+huge_init(struct block *block)
+{
+	struct region *region = FIRST_REGION(block);
+	region->free = false;
+	region->size = (char *) huge_base(block) + block->size -
+	               (char *) REGION2PTR(region);
+	region->last = true;
+	region->prev_offset = 0;
+	set_region_block(region, block);
+	region->magic_number = HUGE_MAGIC_NUMBER;
+	region->zeroed = false;
+	return region;
+}
+
+// links a huge block to the ones in use
+static void
+huge_link(struct block *block)
+{
+	pthread_mutex_lock(&huge_lock);
+	block->previous = NULL;
+	block->next = huge_blocks;
+	if (huge_blocks) {
+		huge_blocks->previous = block;
+	}
+	huge_blocks = block;
+	pthread_mutex_unlock(&huge_lock);
+}
+
+// unlinks a huge block from the ones in use, the huge lock must be held
+static void
+huge_unlink(struct block *block)
+{
+	if (block->previous) {
+		block->previous->next = block->next;
+	} else {
+		huge_blocks = block->next;
+	}
+	if (block->next) {
+		block->next->previous = block->previous;
+	}
+}
+
+// maps a region of its own for a huge request, reusing the smallest cached
+// mapping that can hold it without wasting more than half of it
+static struct region *
+huge_alloc(size_t size, size_t alignment)
+{
+	size_t headers = sizeof(struct block) + sizeof(struct region);
+	size_t block_size = page_round(size + headers);
+	struct block *block = NULL;
+	bool fresh = false;
+	int slot = 0;
+
+	// the size of a region has to fit in its header
+	if (alignment > REGION_MAX_SIZE || size > REGION_MAX_SIZE - alignment) {
+		return NULL;
+	}
+
+	// cached mappings have their header at the start,
+	// so they are only reused for the default alignment
+	decay_huge_cache(now_ms(), false);
+	pthread_mutex_lock(&huge_lock);
+	for (int i = 0; i < HUGE_CACHE_SIZE && alignment <= MIN_ALIGNMENT; i++) {
+		struct block *cached = huge_cache[i];
+		if (cached && cached->size >= block_size &&
+		    cached->size / 2 <= block_size &&
+		    (!block || cached->size < block->size)) {
+			block = cached;
+			slot = i;
+		}
+	}
+	if (block) {
+		huge_cache[slot] = NULL;
+	}
+	pthread_mutex_unlock(&huge_lock);
+
+	if (!block) {
+		size_t map_size = alignment > MIN_ALIGNMENT
+		                          ? page_round(size + headers + alignment)
+		                          : block_size;
+		char *map = mmap(NULL,
+		                 map_size,
+		                 PROT_WRITE | PROT_READ,
+		                 MAP_ANONYMOUS | MAP_PRIVATE,
+		                 0,
+		                 0);
+		if (map == MAP_FAILED) {
+			print_error("ERROR: map failed");
+			return NULL;
+		}
+
+		// the headers go right before the first aligned payload,
+		// the pages left before and after the region are unmapped
+		char *payload = (char *) ALIGN_UP((uintptr_t) map + headers,
+		                                  alignment);
+		block = (struct block *) (payload - headers);
+		char *start = (char *) huge_base(block);
+		char *end = (char *) page_round((uintptr_t) payload + size);
+		if (start > map) {
+			munmap(map, start - map);
+		}
+		if (end < map + map_size) {
+			munmap(end, map + map_size - end);
+		}
+		bind_to_node(start,
+		             end - start,
+		             thread_arena ? thread_arena->node : thread_node());
+		block->size = end - start;
+		block->pages = PAGES_BASE;
+		count_mapped(block->size);
+		fresh = true;
+	}
+	block->arena = NULL;
+	huge_link(block);
+
+	__atomic_fetch_add(&amount_of_huge_blocks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&huge_bytes, block->size, __ATOMIC_RELAXED);
+	struct region *region = huge_init(block);
+	region->zeroed = fresh;
+	region->sampled = false;
+	return region;
+}
+
+// keeps the mapping of a freed huge region in the cache with its pages
+// purged, replacing the oldest one when it is full, or unmaps it if it is
+// too big to be kept
+static void
+huge_free(struct region *region)
+{
+	struct block *base = huge_base(region_block(region));
+	size_t size = region_block(region)->size;
+	struct block *evicted = base;
+	uint64_t now = now_ms();
+
+	__atomic_fetch_sub(&amount_of_huge_blocks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&huge_bytes, size, __ATOMIC_RELAXED);
+
+	// the pages go back before the mapping can be taken from the cache,
+	// all but the ones of the headers
+	char *pages = (char *) page_round((uintptr_t) REGION2PTR(region));
+	if (size <= HUGE_CACHE_MAX_SIZE && purge_decay_ms >= 0 &&
+	    pages < (char *) base + size) {
+		advise_pages(pages, (char *) base + size - pages, PAGES_BASE);
+	}
+
+	decay_huge_cache(now, false);
+	pthread_mutex_lock(&huge_lock);
+	huge_unlink(region_block(region));
+	if (size <= HUGE_CACHE_MAX_SIZE) {
+		// cached mappings have their header at the start
+		base->size = size;
+
+		int slot = -1;
+		for (int i = 0; i < HUGE_CACHE_SIZE && slot < 0; i++) {
+			if (!huge_cache[i]) {
+				slot = i;
+			}
+		}
+		if (slot < 0) {
+			slot = huge_cache_next;
+			huge_cache_next = (slot + 1) % HUGE_CACHE_SIZE;
+		}
+		evicted = huge_cache[slot];
+		huge_cache[slot] = base;
+		huge_cache_since[slot] = now;
+	}
+	pthread_mutex_unlock(&huge_lock);
+
+	if (evicted) {
+		size_t evicted_size = evicted == base ? size : evicted->size;
+		count_mapped(-(ssize_t) evicted_size);
+		munmap(evicted, evicted_size);
+	}
+}
+
+// resizes a huge region by remapping it, returns NULL if mremap fails
+static struct region *
+huge_resize(struct region *region, size_t size)
+{
+	struct block *block = region_block(region);
+	char *base = (char *) huge_base(block);
+	size_t offset = (char *) block - base;
+	size_t block_size = page_round(offset + size + sizeof(struct block) +
+	                               sizeof(struct region));
+	if (size > REGION_MAX_SIZE - MIN_ALIGNMENT) {
+		return NULL;
+	}
+
+	// the block is unlinked while it moves
+	size_t old_size = block->size;
+	pthread_mutex_lock(&huge_lock);
+	huge_unlink(block);
+	pthread_mutex_unlock(&huge_lock);
+	base = mremap(base, old_size, block_size, MREMAP_MAYMOVE);
+	if (base == MAP_FAILED) {
+		huge_link(block);
+		return NULL;
+	}
+	block = (struct block *) (base + offset);
+	block->size = block_size;
+	huge_link(block);
+	count_mapped((ssize_t) block_size - (ssize_t) old_size);
+	__atomic_fetch_add(&huge_bytes, block_size - old_size, __ATOMIC_RELAXED);
+	return huge_init(block);
+}
+
+// returns the arena that owns an allocated pointer
+static struct arena *
+arena_of(void *ptr)
+{
+	if (is_slab_object(ptr)) {
+		return PTR2SLAB(ptr)->arena;
+	}
+	return region_block(PTR2REGION(ptr))->arena;
+}
+
+// returns the bytes that can be used from a pointer,
+// or 0 if it was not returned by this allocator
+static size_t
+usable_size(void *ptr)
+{
+	if (is_slab_object(ptr)) {
+		return SLAB_CLASS_SIZE(PTR2SLAB(ptr)->size_class);
+	}
+	struct region *region = PTR2REGION(ptr);
+	if (region->magic_number != MAGIC_NUMBER &&
+	    region->magic_number != HUGE_MAGIC_NUMBER) {
+		return 0;
+	}
+	return region->size;
+}
+
+// takes the lock of `arena`, keeping it if it is already `locked`
+// returns the arena whose lock is held
+static struct arena *
+arena_relock(struct arena *locked, struct arena *arena)
+{
+	if (arena != locked) {
+		if (locked) {
+			pthread_mutex_unlock(&locked->lock);
+		}
+		pthread_mutex_lock(&arena->lock);
+	}
+	return arena;
+}
+
+// gives back an allocated pointer to its arena, whose lock must be held
+static void
+release_ptr(void *ptr)
+{
+	if (is_slab_object(ptr)) {
+		slab_free(ptr);
+	} else {
+		free_region(PTR2REGION(ptr));
+	}
+}
+
+// queues a pointer freed by a thread of another arena, with a single
+// compare and swap: only the threads of the arena take pointers out of the
+// queue, and they take all of them at once, so a pointer can not be taken
+// and pushed again while the swap is done
+static void
+remote_free_push(struct arena *arena, void *ptr)
+{
+	struct remote_free *entry = ptr;
+	entry->next = __atomic_load_n(&arena->remote_queue, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&arena->remote_queue,
+	                                    &entry->next,
+	                                    entry,
+	                                    true,
+	                                    __ATOMIC_RELEASE,
+	                                    __ATOMIC_RELAXED)) {
+	}
+}
+
+// gives back every pointer queued by other threads, coalescing them as
+// free does, the arena lock must be held
+static void
+remote_free_drain(struct arena *arena)
+{
+	if (!__atomic_load_n(&arena->remote_queue, __ATOMIC_RELAXED)) {
+		return;
+	}
+	struct remote_free *entry =
+	        __atomic_exchange_n(&arena->remote_queue, NULL, __ATOMIC_ACQUIRE);
+	while (entry) {
+		struct remote_free *next = entry->next;
+		// a region that is already free is ignored, like in free
+		if (is_slab_object(entry) || !PTR2REGION(entry)->free) {
+			release_ptr(entry);
+		}
+		arena->remote_frees++;
+		entry = next;
+	}
+}
+
+// takes the lock of the arena of the calling thread in a slow path of
+// malloc, where the pointers other threads freed are given back first
+static void
+arena_lock(struct arena *arena)
+{
+	pthread_mutex_lock(&arena->lock);
+	remote_free_drain(arena);
+}
+
+// gives back to the heap every pointer of the bin but the first `keep`
+static void
+tcache_flush_bin(struct tcache_bin *bin, int keep)
+{
+	struct tcache_entry *entry = bin->head;
+	struct tcache_entry *last_kept = NULL;
+	for (int i = 0; i < keep && entry; i++) {
+		last_kept = entry;
+		entry = entry->next;
+	}
+	if (last_kept) {
+		last_kept->next = NULL;
+	} else {
+		bin->head = NULL;
+	}
+
+	// the lock of an arena is kept while the next pointers belong to it
+	struct arena *locked_arena = NULL;
+	while (entry) {
+		struct tcache_entry *next = entry->next;
+		locked_arena = arena_relock(locked_arena, arena_of(entry));
+		release_ptr(entry);
+		bin->count--;
+		entry = next;
+	}
+	if (locked_arena) {
+		pthread_mutex_unlock(&locked_arena->lock);
+	}
+}
+
+static void
+tcache_flush(struct tcache *cache)
+{
+	for (int i = 0; i < TCACHE_BIN_COUNT; i++) {
+		if (cache->bins[i].count) {
+			tcache_flush_bin(&cache->bins[i], 0);
+		}
+	}
+	for (int i = 0; i < SLAB_CLASSES; i++) {
+		if (cache->slab_bins[i].count) {
+			tcache_flush_bin(&cache->slab_bins[i], 0);
+		}
+	}
+}
+
+static void
+trace_write(const void *data, size_t size)
+{
+	if (write(trace_fd, data, size) < 0) {
+		print_error("ERROR: trace write failed");
+	}
+}
+
+static void
+trace_flush(struct trace_buffer *buffer)
+{
+	if (buffer->count) {
+		trace_write(buffer->records,
+		            buffer->count * sizeof(struct trace_record));
+		buffer->count = 0;
+	}
+}
+
+// returns the buffer of the calling thread, which is only used by it
+static struct trace_buffer *
+trace_buffer_get(void)
+{
+	if (trace_buffer) {
+		return trace_buffer;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	struct trace_buffer *buffer = trace_free_buffers;
+	if (buffer) {
+		trace_free_buffers = buffer->next;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	if (!buffer) {
+		buffer = mmap(NULL,
+		              sizeof(struct trace_buffer),
+		              PROT_WRITE | PROT_READ,
+		              MAP_ANONYMOUS | MAP_PRIVATE,
+		              -1,
+		              0);
+		if (buffer == MAP_FAILED) {
+			return NULL;
+		}
+	}
+	buffer->count = 0;
+	trace_buffer = buffer;
+	return buffer;
+}
+
+// appends a record to the trace, the calls made once the thread cache
+// was destroyed are written right away since the buffer is not flushed again
+static void
+trace_record(enum trace_op op, void *address, uintptr_t argument, size_t size)
+{
+	if (trace_fd < 0) {
+		return;
+	}
+
+	if (!trace_thread) {
+		trace_thread = __atomic_add_fetch(&trace_threads,
+		                                  1,
+		                                  __ATOMIC_RELAXED);
+	}
+	struct trace_record record = {
+		.time = now_ns() - trace_start,
+		.address = (uintptr_t) address,
+		.argument = argument,
+		.size = size > UINT32_MAX ? UINT32_MAX : size,
+		.thread = trace_thread,
+		.op = op,
+	};
+
+	struct trace_buffer *buffer = NULL;
+	if (tcache.state != TCACHE_DISABLED) {
+		buffer = trace_buffer_get();
+	}
+	if (!buffer) {
+		trace_write(&record, sizeof(record));
+		return;
+	}
+	buffer->records[buffer->count++] = record;
+	if (buffer->count == TRACE_BUFFER_RECORDS) {
+		trace_flush(buffer);
+	}
+}
+
+// writes the records of an exiting thread and keeps its buffer for another
+static void
+trace_thread_exit(void)
+{
+	struct trace_buffer *buffer = trace_buffer;
+	if (!buffer) {
+		return;
+	}
+	trace_flush(buffer);
+	trace_buffer = NULL;
+
+	pthread_mutex_lock(&trace_lock);
+	buffer->next = trace_free_buffers;
+	trace_free_buffers = buffer;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// approximates the natural logarithm of x > 0 without libm,
+// precise enough to draw the sampling intervals
+static double
+fast_log(double x)
+{
+	union {
+		double d;
+		uint64_t u;
+	} v = { .d = x };
+	// x = m * 2^e with m in [1, 2), the polynomial is log2(m) + 1
+	int exponent = (int) ((v.u >> 52) & 0x7ff) - 1024;
+	v.u = (v.u & ((1ULL << 52) - 1)) | (1023ULL << 52);
+	double log2 =
+	        exponent + (-0.34484843 * v.d + 2.02466578) * v.d - 0.67487759;
+	return log2 * 0.69314718;
+}
+
+// draws the bytes until the next sample of a thread from an exponential
+// distribution: samples are a Poisson process over the allocated bytes,
+// so every byte has the same odds of being sampled whatever its call size
+static int64_t
+prof_next_interval(struct tcache *cache)
+{
+	// xorshift64
+	uint64_t x = cache->prof_seed;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	cache->prof_seed = x;
+
+	// uniform in (0, 1]
+	double u = ((x >> 11) + 1) / 9007199254740992.0;
+	double interval = -fast_log(u) * prof_interval;
+	return interval < 1 ? 1 : (int64_t) interval;
+}
+
+// counts the bytes of an allocation of the thread,
+// returns true if it has to be sampled
+static bool
+prof_sample_due(struct tcache *cache, size_t size)
+{
+	if (!__atomic_load_n(&prof_ready, __ATOMIC_ACQUIRE) || !cache ||
+	    cache->prof_busy) {
+		return false;
+	}
+	if (!cache->prof_seed) {
+		cache->prof_seed = ((uintptr_t) cache ^ now_ns()) | 1;
+		cache->prof_bytes = prof_next_interval(cache);
+	}
+
+	cache->prof_bytes -= size;
+	if (cache->prof_bytes > 0) {
+		return false;
+	}
+	cache->prof_bytes = prof_next_interval(cache);
+	return true;
+}
+
+// finds a stack in the table, adding it if it is new
+// the prof lock must be held
+static struct prof_stack *
+prof_stack_get(void **frames, int depth)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < depth; i++) {
+		hash = (hash ^ (uintptr_t) frames[i]) * 1099511628211ULL;
+	}
+
+	for (int tries = 0, i = hash % PROF_STACKS; tries < PROF_STACKS;
+	     tries++, i = (i + 1) % PROF_STACKS) {
+		struct prof_stack *stack = &prof_stacks[i];
+		if (!stack->depth) {
+			stack->hash = hash;
+			stack->depth = depth;
+			memcpy(stack->frames, frames, depth * sizeof(void *));
+			return stack;
+		}
+		if (stack->hash == hash && stack->depth == depth &&
+		    !memcmp(stack->frames, frames, depth * sizeof(void *))) {
+			return stack;
+		}
+	}
+	return NULL;
+}
+
+// live samples are kept in an open addressing table, by pointer
+static size_t
+prof_slot(void *ptr)
+{
+	return ((((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15ULL) >> 32) &
+	       (PROF_SAMPLES - 1);
+}
+
+// returns the slot of a live sample, or -1
+static long
+prof_find(void *ptr)
+{
+	for (size_t i = prof_slot(ptr); prof_samples[i].ptr;
+	     i = (i + 1) & (PROF_SAMPLES - 1)) {
+		if (prof_samples[i].ptr == ptr) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void
+prof_insert(struct prof_sample *sample)
+{
+	size_t i = prof_slot(sample->ptr);
+	while (prof_samples[i].ptr) {
+		i = (i + 1) & (PROF_SAMPLES - 1);
+	}
+	prof_samples[i] = *sample;
+}
+
+// empties a slot, moving back the samples that were displaced past it
+static void
+prof_remove(size_t hole)
+{
+	for (size_t i = (hole + 1) & (PROF_SAMPLES - 1); prof_samples[i].ptr;
+	     i = (i + 1) & (PROF_SAMPLES - 1)) {
+		size_t home = prof_slot(prof_samples[i].ptr);
+		if (((i - home) & (PROF_SAMPLES - 1)) >=
+		    ((i - hole) & (PROF_SAMPLES - 1))) {
+			prof_samples[hole] = prof_samples[i];
+			hole = i;
+		}
+	}
+	prof_samples[hole].ptr = NULL;
+}
+
+// a buffer in the stack for the profile being written
+struct prof_writer {
+	int fd;
+	size_t len;
+	char buf[4096];
+};
+
+static void
+prof_flush(struct prof_writer *writer)
+{
+	for (size_t done = 0; done < writer->len;) {
+		ssize_t n = write(writer->fd,
+		                  writer->buf + done,
+		                  writer->len - done);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	writer->len = 0;
+}
+
+static void
+prof_printf(struct prof_writer *writer, const char *format, ...)
+{
+	va_list args;
+	for (int tries = 0; tries < 2; tries++) {
+		size_t room = sizeof(writer->buf) - writer->len;
+		va_start(args, format);
+		int n = vsnprintf(writer->buf + writer->len, room, format, args);
+		va_end(args);
+		if (n >= 0 && (size_t) n < room) {
+			writer->len += n;
+			return;
+		}
+		prof_flush(writer);
+	}
+}
+
+// writes the heap profile in the heap_v2 format of pprof: a line for each
+// stack with its live and total sampled objects and bytes, which pprof
+// scales by the sampling interval, then the mappings of the process
+// the prof lock must be held, returns 0 or an errno
+static int
+prof_dump_locked(const char *path)
+{
+	char name[PATH_MAX];
+	if (!prof_stacks) {
+		return EINVAL;
+	}
+	if (!path) {
+		snprintf(name,
+		         sizeof(name),
+		         "%.*s.%d.%u.heap",
+		         prof_prefix_len,
+		         prof_prefix,
+		         getpid(),
+		         prof_dumps++);
+		path = name;
+	}
+
+	struct prof_writer writer = { .len = 0 };
+	writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (writer.fd < 0) {
+		return errno;
+	}
+
+	struct prof_stack total = { .depth = 0 };
+	for (int i = 0; i < PROF_STACKS; i++) {
+		total.live_objects += prof_stacks[i].live_objects;
+		total.live_bytes += prof_stacks[i].live_bytes;
+		total.allocated_objects += prof_stacks[i].allocated_objects;
+		total.allocated_bytes += prof_stacks[i].allocated_bytes;
+	}
+	prof_printf(&writer,
+	            "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%zu\n",
+	            total.live_objects,
+	            total.live_bytes,
+	            total.allocated_objects,
+	            total.allocated_bytes,
+	            prof_interval);
+
+	for (int i = 0; i < PROF_STACKS; i++) {
+		struct prof_stack *stack = &prof_stacks[i];
+		if (!stack->depth) {
+			continue;
+		}
+		prof_printf(&writer,
+		            "%lu: %lu [%lu: %lu] @",
+		            stack->live_objects,
+		            stack->live_bytes,
+		            stack->allocated_objects,
+		            stack->allocated_bytes);
+		for (int frame = 0; frame < stack->depth; frame++) {
+			prof_printf(&writer, " %p", stack->frames[frame]);
+		}
+		prof_printf(&writer, "\n");
+	}
+
+	// pprof finds the symbols of the addresses with the mappings
+	prof_printf(&writer, "\nMAPPED_LIBRARIES:\n");
+	prof_flush(&writer);
+	int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (maps >= 0) {
+		ssize_t n;
+		while ((n = read(maps, writer.buf, sizeof(writer.buf))) > 0) {
+			writer.len = n;
+			prof_flush(&writer);
+		}
+		close(maps);
+	}
+
+	close(writer.fd);
+	return 0;
+}
+
+// writes the profile asked for by a signal that came while it was not
+// possible, because the thread that got it held the prof lock
+static void
+prof_dump_if_pending(void)
+{
+	if (prof_dump_pending) {
+		pthread_mutex_lock(&prof_lock);
+		if (prof_dump_pending) {
+			prof_dump_pending = false;
+			prof_dump_locked(NULL);
+		}
+		pthread_mutex_unlock(&prof_lock);
+	}
+}
+
+// records a sampled allocation with the call stack that made it
+static void
+prof_sample(struct tcache *cache, struct region *region, size_t size)
+{
+	void *frames[PROF_MAX_DEPTH + 1];
+
+	// the stack starts at the caller of this function
+	cache->prof_busy = true;
+	int depth = backtrace(frames, PROF_MAX_DEPTH + 1) - 1;
+	cache->prof_busy = false;
+
+	pthread_mutex_lock(&prof_lock);
+	struct prof_stack *stack =
+	        depth > 0 ? prof_stack_get(frames + 1, depth) : NULL;
+	if (stack && prof_live_samples < PROF_SAMPLES / 4 * 3) {
+		struct prof_sample sample = {
+			.ptr = REGION2PTR(region),
+			.size = size,
+			.stack = stack,
+		};
+		prof_insert(&sample);
+		prof_live_samples++;
+		stack->live_objects++;
+		stack->live_bytes += size;
+		stack->allocated_objects++;
+		stack->allocated_bytes += size;
+		// the header word is only written by the owner of the region
+		region->sampled = true;
+	} else {
+		prof_dropped++;
+	}
+	pthread_mutex_unlock(&prof_lock);
+	prof_dump_if_pending();
+}
+
+// forgets a sampled allocation that is being freed
+static void
+prof_free(struct region *region)
+{
+	pthread_mutex_lock(&prof_lock);
+	long slot = prof_find(REGION2PTR(region));
+	if (slot >= 0) {
+		struct prof_sample *sample = &prof_samples[slot];
+		sample->stack->live_objects--;
+		sample->stack->live_bytes -= sample->size;
+		prof_remove(slot);
+		prof_live_samples--;
+	}
+	region->sampled = false;
+	pthread_mutex_unlock(&prof_lock);
+	prof_dump_if_pending();
+}
+
+// follows a sampled allocation moved by realloc
+static void
+prof_move(void *old_ptr, void *new_ptr)
+{
+	pthread_mutex_lock(&prof_lock);
+	long slot = prof_find(old_ptr);
+	if (slot >= 0) {
+		struct prof_sample sample = prof_samples[slot];
+		prof_remove(slot);
+		sample.ptr = new_ptr;
+		prof_insert(&sample);
+	}
+	pthread_mutex_unlock(&prof_lock);
+}
+
+// maps the tables of the profiler, which are never given back
+static void
+prof_init(void)
+{
+	size_t stacks_size = page_round(PROF_STACKS * sizeof(struct prof_stack));
+	size_t samples_size =
+	        page_round(PROF_SAMPLES * sizeof(struct prof_sample));
+	void *stacks = mmap(NULL,
+	                    stacks_size,
+	                    PROT_READ | PROT_WRITE,
+	                    MAP_ANONYMOUS | MAP_PRIVATE,
+	                    -1,
+	                    0);
+	void *samples = mmap(NULL,
+	                     samples_size,
+	                     PROT_READ | PROT_WRITE,
+	                     MAP_ANONYMOUS | MAP_PRIVATE,
+	                     -1,
+	                     0);
+	if (stacks == MAP_FAILED || samples == MAP_FAILED) {
+		print_error("ERROR: map failed");
+		return;
+	}
+
+	// the first backtrace loads the unwinder, which allocates
+	void *frame;
+	backtrace(&frame, 1);
+
+	prof_stacks = stacks;
+	prof_samples = samples;
+}
+
+// starts sampling every `interval` bytes on average, or stops if it is 0
+// returns false if the tables of the profiler could not be mapped
+static bool
+prof_enable(size_t interval)
+{
+	if (!interval) {
+		__atomic_store_n(&prof_ready, false, __ATOMIC_RELEASE);
+		return true;
+	}
+	pthread_once(&prof_once, prof_init);
+	if (!prof_stacks) {
+		return false;
+	}
+	prof_interval = interval;
+	__atomic_store_n(&prof_ready, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+// asks for a profile when the signal set with prof_signal arrives, it is
+// written by the next sample or free of a sample, or by the background
+// thread, since writing it is not async-signal-safe
+static void
+prof_signal_handler(int signal __attribute__((unused)))
+{
+	prof_dump_pending = true;
+}
+
+// adds the counters of a thread to the ones of `to`
+static void
+stats_merge(struct thread_stats *to, struct thread_stats *from)
+{
+	to->mallocs += COUNTER_READ(from->mallocs);
+	to->frees += COUNTER_READ(from->frees);
+	to->requested_memory += COUNTER_READ(from->requested_memory);
+	to->allocated += COUNTER_READ(from->allocated);
+	for (int i = 0; i < STATS_SIZE_CLASSES; i++) {
+		to->class_mallocs[i] += COUNTER_READ(from->class_mallocs[i]);
+		to->class_frees[i] += COUNTER_READ(from->class_frees[i]);
+	}
+}
+
+// drains the cache of a thread when it exits
+static void
+tcache_destroy(void *arg)
+{
+	struct tcache *cache = arg;
+
+	tcache_flush(cache);
+	trace_thread_exit();
+	cache->state = TCACHE_DISABLED;
+
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(&exited_stats, &cache->stats);
+	if (cache->prev) {
+		cache->prev->next = cache->next;
+	} else {
+		tcaches = cache->next;
+	}
+	if (cache->next) {
+		cache->next->prev = cache->prev;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void
+tcache_create_key(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// returns the cache of the calling thread,
+// or NULL once the thread has started to exit
+static struct tcache *
+tcache_get(void)
+{
+	if (tcache.state == TCACHE_ACTIVE) {
+		return &tcache;
+	}
+	if (tcache.state == TCACHE_DISABLED) {
+		return NULL;
+	}
+
+	// first call of the thread
+	pthread_once(&tcache_key_once, tcache_create_key);
+	pthread_setspecific(tcache_key, &tcache);
+
+	pthread_mutex_lock(&stats_lock);
+	tcache.prev = NULL;
+	tcache.next = tcaches;
+	if (tcaches) {
+		tcaches->prev = &tcache;
+	}
+	tcaches = &tcache;
+	pthread_mutex_unlock(&stats_lock);
+
+	tcache.state = TCACHE_ACTIVE;
+	return &tcache;
+}
+
+static void *
+tcache_pop(struct tcache_bin *bin)
+{
+	struct tcache_entry *entry = bin->head;
+	if (entry) {
+		bin->head = entry->next;
+		bin->count--;
+	}
+	return entry;
+}
+
+// caches a pointer that is being freed
+// a full bin gives back its oldest half to the heap first
+static void
+tcache_push(struct tcache *cache, struct tcache_bin *bin, void *ptr)
+{
+	struct tcache_entry *entry = ptr;
+
+	// the key marks pointers that may already be in this cache
+	if (entry->key == cache) {
+		for (struct tcache_entry *e = bin->head; e; e = e->next) {
+			assert(e != entry);
+		}
+	}
+
+	if (bin->count >= TCACHE_BIN_MAX) {
+		tcache_flush_bin(bin, TCACHE_FLUSH_BATCH);
+	}
+
+	entry->next = bin->head;
+	entry->key = cache;
+	bin->head = entry;
+	bin->count++;
+}
+
+// runs the time based work of every arena, so that
+// it does not have to be done by malloc and free
+static void *
+background_purge_thread(void *arg __attribute__((unused)))
+{
+	long interval = purge_decay_ms / PURGE_DECAY_STEPS;
+	if (interval < PURGE_MIN_INTERVAL_MS) {
+		interval = PURGE_MIN_INTERVAL_MS;
+	}
+	struct timespec sleep_time = {
+		.tv_sec = interval / 1000,
+		.tv_nsec = (interval % 1000) * 1000000,
+	};
+
+	for (;;) {
+		nanosleep(&sleep_time, NULL);
+		uint64_t now = now_ms();
+		for (int i = 0; i < MAX_ARENAS; i++) {
+			// the arenas whose threads are gone are drained here
+			arena_lock(&arenas[i]);
+			arena_decay(&arenas[i], now);
+			pthread_mutex_unlock(&arenas[i].lock);
+		}
+		prof_dump_if_pending();
+	}
+	return NULL;
+}
+
+// parses a number with an optional k, m or g suffix, that has to
+// take all the bytes up to `end`
+static bool
+parse_number(const char *value, const char *end, long *result)
+{
+	char *suffix;
+	errno = 0;
+	long number = strtol(value, &suffix, 10);
+	if (errno || suffix == value) {
+		return false;
+	}
+	if (suffix < end) {
+		long unit;
+		switch (*suffix++) {
+		case 'k':
+			unit = 1024L;
+			break;
+		case 'm':
+			unit = 1024L * 1024;
+			break;
+		case 'g':
+			unit = 1024L * 1024 * 1024;
+			break;
+		default:
+			return false;
+		}
+		if (__builtin_mul_overflow(number, unit, &number)) {
+			return false;
+		}
+	}
+	*result = number;
+	return suffix == end;
+}
+
+static bool
+parse_fit(const char *value, size_t len, enum fit_policy *result)
+{
+	for (int fit = FIT_NONE; fit < FIT_POLICIES; fit++) {
+		if (strlen(fit_names[fit]) == len &&
+		    !strncmp(value, fit_names[fit], len)) {
+#ifndef TLSF
+			// there is no index to look for the regions in
+			if (fit == FIT_TLSF) {
+				return false;
+			}
+#endif
+			*result = fit;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool
+is_option(const char *name, size_t len, const char *option)
+{
+	return strlen(option) == len && !strncmp(name, option, len);
+}
+
+// applies an option of MALLOC_CONF, returns false if it is not valid
+static bool
+set_option(const char *name, size_t len, const char *value, const char *end)
+{
+	static const char *fit_options[BLOCK_TYPES] = {
+		"fit_little",
+		"fit_mid",
+		"fit_large",
+	};
+	static const char *size_options[BLOCK_TYPES] = {
+		"little_block_size",
+		"mid_block_size",
+		"large_block_size",
+	};
+	static const char *max_options[BLOCK_TYPES] = {
+		"max_little_blocks",
+		"max_mid_blocks",
+		"max_large_blocks",
+	};
+	static const char *reserve_options[BLOCK_TYPES] = {
+		"reserve_little",
+		"reserve_mid",
+		"reserve_large",
+	};
+	enum fit_policy fit;
+	long number;
+
+	if (is_option(name, len, "fit")) {
+		if (!parse_fit(value, end - value, &fit)) {
+			return false;
+		}
+		for (int type = 0; type < BLOCK_TYPES; type++) {
+			fit_policies[type] = fit;
+		}
+		return true;
+	}
+	for (int type = 0; type < BLOCK_TYPES; type++) {
+		if (is_option(name, len, fit_options[type])) {
+			return parse_fit(value, end - value, &fit_policies[type]);
+		}
+	}
+	if (is_option(name, len, "huge_pages")) {
+		for (size_t i = 0;
+		     i < sizeof(huge_pages_names) / sizeof(huge_pages_names[0]);
+		     i++) {
+			if (is_option(value, end - value, huge_pages_names[i])) {
+				huge_pages = i;
+				return true;
+			}
+		}
+		return false;
+	}
+	if (is_option(name, len, "background_thread")) {
+		background_thread = is_option(value, end - value, "true");
+		return background_thread || is_option(value, end - value, "false");
+	}
+	if (is_option(name, len, "reserve_prefault") ||
+	    is_option(name, len, "reserve_mlock")) {
+		int flag = is_option(name, len, "reserve_mlock")
+		                   ? MALLOC_RESERVE_MLOCK
+		                   : MALLOC_RESERVE_PREFAULT;
+		if (is_option(value, end - value, "true")) {
+			reserve_flags |= flag;
+			return true;
+		}
+		reserve_flags &= ~flag;
+		return is_option(value, end - value, "false");
+	}
+	if (is_option(name, len, "prof_prefix")) {
+		prof_prefix = value;
+		prof_prefix_len = end - value;
+		return prof_prefix_len > 0;
+	}
+
+	if (!parse_number(value, end, &number)) {
+		return false;
+	}
+	if (is_option(name, len, "decay_ms")) {
+		purge_decay_ms = number < 0 ? -1 : number;
+		return true;
+	}
+	if (is_option(name, len, "prof_sample")) {
+		prof_interval = number < 0 ? 0 : number;
+		return true;
+	}
+	if (is_option(name, len, "prof_signal")) {
+		if (number <= 0 || number >= NSIG) {
+			return false;
+		}
+		prof_signal = number;
+		return true;
+	}
+	if (is_option(name, len, "numa_nodes")) {
+		if (number < 0 || number > MAX_NUMA_NODES) {
+			return false;
+		}
+		numa_nodes = number;
+		return true;
+	}
+	if (is_option(name, len, "min_region_size")) {
+		if (number < MIN_ALIGNMENT || number > 64 * 1024) {
+			return false;
+		}
+		min_size_region = ALIGN16(number);
+		return true;
+	}
+	for (int type = 0; type < BLOCK_TYPES; type++) {
+		if (is_option(name, len, size_options[type])) {
+			if (number <= 0 || number > (long) MAX_BLOCK_SIZE) {
+				return false;
+			}
+			block_sizes[type] = page_round(number);
+			return true;
+		}
+		if (is_option(name, len, max_options[type])) {
+			if (number < 0 || number > INT_MAX) {
+				return false;
+			}
+			max_blocks[type] = number;
+			return true;
+		}
+		if (is_option(name, len, reserve_options[type])) {
+			if (number < 0 || number > INT_MAX) {
+				return false;
+			}
+			reserve_counts[type] = number;
+			return true;
+		}
+	}
+	return false;
+}
+
+// reads MALLOC_CONF, a list of `option:value` separated by commas:
+//   little_block_size, mid_block_size, large_block_size: size of each type
+//   of block, with an optional k, m or g suffix
+//   max_little_blocks, max_mid_blocks, max_large_blocks: blocks of each
+//   type an arena may have
+//   min_region_size: smallest region given by malloc
+//   fit: how free regions are looked for (none, first, best, address, next
+//   or tlsf if it was built with TLSF), fit_little, fit_mid and fit_large
+//   set it for a single type of block
+//   huge_pages: none, thp to map the mid and large blocks aligned to huge
+//   pages and advise the kernel to use transparent ones, or hugetlb to
+//   take them from the reserved ones, falling back to thp
+//   numa_nodes: nodes the arenas are split among, 0 (the default) uses the
+//   ones of the machine, other amounts are emulated
+//   reserve_little, reserve_mid, reserve_large: blocks of each type mapped
+//   for each node at startup, see malloc_reserve
+//   reserve_prefault, reserve_mlock: if true, the pages of the reserved
+//   blocks are faulted in, or locked in memory
+//   decay_ms: time until the pages of the free regions are all purged,
+//   following the decay curve, -1 disables purging
+//   background_thread: if true, purging is done by a background thread
+//   prof_sample: average bytes between sampled allocations of the heap
+//   profile, 0 disables it
+//   prof_prefix: start of the name of the profiles, malloc by default
+//   prof_signal: number of a signal that writes a profile
+// e.g. MALLOC_CONF=little_block_size:64k,fit:best,fit_large:first
+// it runs before the first block is created, and does not allocate
+static void
+conf_init(void)
+{
+	const char *conf = getenv("MALLOC_CONF");
+	if (!conf) {
+		return;
+	}
+
+	size_t defaults[BLOCK_TYPES];
+	memcpy(defaults, block_sizes, sizeof(defaults));
+
+	while (*conf) {
+		const char *end = strchrnul(conf, ',');
+		const char *colon = memchr(conf, ':', end - conf);
+		if (!colon || !set_option(conf, colon - conf, colon + 1, end)) {
+			print_conf_error("invalid option ", conf, end - conf);
+		}
+		conf = *end ? end + 1 : end;
+	}
+
+	// a block type holds the sizes bigger than the previous type
+	for (int type = 1; type < BLOCK_TYPES; type++) {
+		if (block_sizes[type] <= block_sizes[type - 1]) {
+			print_conf_error("block sizes must grow, using the defaults",
+			                 "",
+			                 0);
+			memcpy(block_sizes, defaults, sizeof(defaults));
+			break;
+		}
+	}
+
+	// the blocks backed by huge pages hold whole ones
+	if (huge_pages != HUGE_PAGES_NONE) {
+		for (int type = MID_BLOCK; type < BLOCK_TYPES; type++) {
+			block_sizes[type] =
+			        ALIGN_UP(block_sizes[type], HUGE_PAGE_SIZE);
+		}
+		if (block_sizes[LARGE_BLOCK] == block_sizes[MID_BLOCK]) {
+			block_sizes[LARGE_BLOCK] += HUGE_PAGE_SIZE;
+		}
+	}
+}
+
+// reads the ids of a list of nodes like 0-1,3 into `ids`, returns how
+// many there are, or 0 if they are more than MAX_NUMA_NODES or an id does
+// not fit in the mask given to mbind
+static unsigned int
+parse_node_list(const char *list, unsigned int *ids)
+{
+	unsigned int nodes = 0;
+	for (const char *c = list; *c;) {
+		char *end;
+		unsigned long first = strtoul(c, &end, 10);
+		if (end == c) {
+			c++;
+			continue;
+		}
+		unsigned long last = first;
+		if (*end == '-') {
+			char *range_end;
+			last = strtoul(end + 1, &range_end, 10);
+			if (range_end == end + 1) {
+				last = first;
+			}
+			end = range_end;
+		}
+		for (unsigned long id = first; id <= last; id++) {
+			if (nodes == MAX_NUMA_NODES ||
+			    id >= sizeof(unsigned long) * CHAR_BIT) {
+				return 0;
+			}
+			ids[nodes++] = id;
+		}
+		c = end;
+	}
+	return nodes;
+}
+
+// the nodes in /sys/devices/system/node/online, with their ids in
+// `ids`, 1 if they can not be read or can not be told apart
+static unsigned int
+online_nodes(unsigned int *ids)
+{
+	char list[128];
+	int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 1;
+	}
+	ssize_t len = read(fd, list, sizeof(list) - 1);
+	close(fd);
+	if (len <= 0) {
+		return 1;
+	}
+	list[len] = '\0';
+
+	unsigned int nodes = parse_node_list(list, ids);
+	return nodes ? nodes : 1;
+}
+
+static void
+arenas_init(void)
+{
+	conf_init();
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		cpus = 1;
+	}
+	amount_of_arenas = cpus * ARENAS_PER_CPU;
+	if (amount_of_arenas > MAX_ARENAS) {
+		amount_of_arenas = MAX_ARENAS;
+	}
+
+	// the memory is only bound to the nodes of the machine, a machine
+	// with more nodes than can be told apart is taken as a single one
+	unsigned int online = online_nodes(node_ids);
+	amount_of_nodes = numa_nodes ? numa_nodes : online;
+	numa_bind = amount_of_nodes > 1 && amount_of_nodes == online;
+
+	// every node gets the same amount of arenas
+	if (amount_of_arenas < amount_of_nodes) {
+		amount_of_arenas = amount_of_nodes;
+	}
+	amount_of_arenas -= amount_of_arenas % amount_of_nodes;
+	for (int i = 0; i < MAX_ARENAS; i++) {
+		arenas[i].node = i % amount_of_nodes;
+	}
+}
+
+// reads the settings before main, so that the background thread and the
+// profiler can be started, the first allocation reads them if it happens
+// earlier
+__attribute__((constructor)) static void
+settings_init(void)
+{
+	pthread_once(&arenas_once, arenas_init);
+
+	int error = 0;
+	for (unsigned int node = 0; node < amount_of_nodes && !error; node++) {
+		for (int type = 0; type < BLOCK_TYPES && !error; type++) {
+			error = reserve_blocks(node,
+			                       type,
+			                       reserve_counts[type],
+			                       reserve_flags);
+		}
+	}
+	if (error) {
+		errno = error;
+		print_error("ERROR: reserve failed");
+	}
+
+	if (background_thread) {
+		pthread_t thread;
+		if (!pthread_create(&thread, NULL, background_purge_thread, NULL)) {
+			pthread_detach(thread);
+			background_purge = true;
+		}
+	}
+
+	if (prof_interval && !prof_enable(prof_interval)) {
+		prof_interval = 0;
+	}
+	if (prof_signal) {
+		struct sigaction action = {
+			.sa_handler = prof_signal_handler,
+			.sa_flags = SA_RESTART,
+		};
+		sigemptyset(&action.sa_mask);
+		sigaction(prof_signal, &action, NULL);
+	}
+}
+
+// every lock is taken before fork, so that the child gets a consistent heap
+static void
+fork_prepare(void)
+{
+	for (int i = 0; i < MAX_ARENAS; i++) {
+		pthread_mutex_lock(&arenas[i].lock);
+	}
+	pthread_mutex_lock(&slab_zone_lock);
+	pthread_mutex_lock(&huge_lock);
+	pthread_mutex_lock(&reserve_lock);
+	pthread_mutex_lock(&stats_lock);
+	pthread_mutex_lock(&trace_lock);
+	pthread_mutex_lock(&prof_lock);
+}
+
+static void
+fork_parent(void)
+{
+	pthread_mutex_unlock(&prof_lock);
+	pthread_mutex_unlock(&trace_lock);
+	pthread_mutex_unlock(&stats_lock);
+	pthread_mutex_unlock(&reserve_lock);
+	pthread_mutex_unlock(&huge_lock);
+	pthread_mutex_unlock(&slab_zone_lock);
+	for (int i = 0; i < MAX_ARENAS; i++) {
+		pthread_mutex_unlock(&arenas[i].lock);
+	}
+}
+
+// the child only has the thread that called fork: the caches of the other
+// threads are forgotten, since their memory may be reused, and the
+// background thread is not running anymore
+static void
+fork_child(void)
+{
+	for (struct tcache *c = tcaches; c; c = c->next) {
+		if (c != &tcache) {
+			stats_merge(&exited_stats, &c->stats);
+		}
+	}
+	tcaches = NULL;
+	if (tcache.state == TCACHE_ACTIVE) {
+		tcache.prev = NULL;
+		tcache.next = NULL;
+		tcaches = &tcache;
+	}
+	background_purge = false;
+
+	// the records of the child would be mixed with the ones of the parent
+	if (trace_fd >= 0) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+
+	pthread_mutex_init(&prof_lock, NULL);
+	pthread_mutex_init(&trace_lock, NULL);
+	pthread_mutex_init(&stats_lock, NULL);
+	pthread_mutex_init(&reserve_lock, NULL);
+	pthread_mutex_init(&huge_lock, NULL);
+	pthread_mutex_init(&slab_zone_lock, NULL);
+	for (int i = 0; i < MAX_ARENAS; i++) {
+		pthread_mutex_init(&arenas[i].lock, NULL);
+	}
+}
+
+__attribute__((constructor)) static void
+fork_init(void)
+{
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+// opens the trace file named by MALLOC_TRACE_FILE, see trace.h
+__attribute__((constructor)) static void
+trace_init(void)
+{
+	char *path = getenv("MALLOC_TRACE_FILE");
+	if (!path) {
+		return;
+	}
+
+	int fd = open(path,
+	              O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+	              0644);
+	if (fd < 0) {
+		print_error("ERROR: can not open the trace file");
+		return;
+	}
+	struct trace_header header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(struct trace_record),
+	};
+	trace_start = now_ns();
+	trace_fd = fd;
+	trace_write(&header, sizeof(header));
+}
+
+// the records of the other threads that are still running are lost
+__attribute__((destructor)) static void
+trace_fini(void)
+{
+	if (trace_fd >= 0 && trace_buffer) {
+		trace_flush(trace_buffer);
+	}
+}
+
+// the threads of a node are assigned to its arenas in round robin
+static struct arena *
+node_arena(unsigned int node)
+{
+	unsigned int per_node = amount_of_arenas / amount_of_nodes;
+	unsigned int arena =
+	        __atomic_fetch_add(&next_arena[node], 1, __ATOMIC_RELAXED);
+	return &arenas[node + (arena % per_node) * amount_of_nodes];
+}
+
+// returns the arena of the calling thread, one of the node it runs on
+// the first time it allocates
+static struct arena *
+arena_get(void)
+{
+	if (!thread_arena) {
+		pthread_once(&arenas_once, arenas_init);
+		unsigned int node =
+		        numa_bind ? thread_node()
+		                  : __atomic_fetch_add(&next_node,
+		                                       1,
+		                                       __ATOMIC_RELAXED) %
+		                            amount_of_nodes;
+		thread_arena = node_arena(node);
+	}
+	return thread_arena;
+}
+
+// the counters of the calling thread, or the ones of the exited threads
+// with the stats lock held if it has no cache anymore
+static struct thread_stats *
+stats_get(struct tcache *cache)
+{
+	if (cache) {
+		return &cache->stats;
+	}
+	pthread_mutex_lock(&stats_lock);
+	return &exited_stats;
+}
+
+static void
+stats_put(struct tcache *cache)
+{
+	if (!cache) {
+		pthread_mutex_unlock(&stats_lock);
+	}
+}
+
+// counts `n` mallocs of `size` bytes each
+static void
+count_mallocs(struct tcache *cache, size_t n, size_t size)
+{
+	struct thread_stats *stats = stats_get(cache);
+	COUNTER_ADD(stats->mallocs, n);
+	COUNTER_ADD(stats->requested_memory, n * size);
+	stats_put(cache);
+}
+
+static void
+count_malloc(struct tcache *cache, size_t size)
+{
+	count_mallocs(cache, 1, size);
+}
+
+static void
+count_frees(struct tcache *cache, size_t n)
+{
+	struct thread_stats *stats = stats_get(cache);
+	COUNTER_ADD(stats->frees, n);
+	stats_put(cache);
+}
+
+static void
+count_free(struct tcache *cache)
+{
+	count_frees(cache, 1);
+}
+
+static int
+stats_size_class(size_t size)
+{
+	return size <= 1 ? 0 : 64 - __builtin_clzl(size - 1);
+}
+
+// accounts the usable bytes of `n` pointers handed out or given back
+static void
+count_usables(struct tcache *cache, size_t n, size_t size, bool freed)
+{
+	int size_class = stats_size_class(size);
+	struct thread_stats *stats = stats_get(cache);
+	if (freed) {
+		COUNTER_ADD(stats->allocated, -(int64_t) (n * size));
+		COUNTER_ADD(stats->class_frees[size_class], n);
+	} else {
+		COUNTER_ADD(stats->allocated, n * size);
+		COUNTER_ADD(stats->class_mallocs[size_class], n);
+	}
+	stats_put(cache);
+}
+
+static void
+count_usable(struct tcache *cache, size_t size, bool freed)
+{
+	count_usables(cache, 1, size, freed);
+}
+
+// gets a tiny object from the thread cache or the slabs of the arena
+static void *
+allocate_tiny(struct tcache *cache, int size_class)
+{
+	if (cache) {
+		void *object = tcache_pop(&cache->slab_bins[size_class]);
+		if (object) {
+			return object;
+		}
+	}
+
+	struct arena *arena = arena_get();
+	arena_lock(arena);
+	void *object = slab_alloc(arena, size_class);
+	pthread_mutex_unlock(&arena->lock);
+	return object;
+}
+
+// allocates memory for malloc and calloc, `zeroed` tells
+// if all but the first FREE_REGION_LINKS_SIZE bytes are known to be zero
+static void *
+allocate(size_t size, bool *zeroed)
+{
+	struct region *new_region;
+	struct tcache *cache = tcache_get();
+	size_t requested = size;
+	// sampled allocations always get a region, to be marked in its header
+	bool sampled = prof_sample_due(cache, size);
+	bool tiny = size <= SLAB_MAX_SIZE && !sampled;
+
+	// tiny sizes are served by the slabs, without any header
+	if (tiny) {
+		int size_class = SLAB_CLASS(size);
+		count_malloc(cache, SLAB_CLASS_SIZE(size_class));
+		void *object = allocate_tiny(cache, size_class);
+		*zeroed = false;
+		if (object) {
+			count_usable(cache, usable_size(object), false);
+			return object;
+		}
+		// the slab zone is exhausted, a region is used instead
+	}
+
+	// set minimum size (256 bytes)
+	if (size < min_size_region) {
+		size = min_size_region;
+	}
+
+	// updates statistics
+	if (!tiny) {
+		count_malloc(cache, size);
+	}
+
+	// aligns to multiple of 16 bytes, so the next header is aligned too
+	size = ALIGN16(size);
+
+	// small sizes are served by the thread cache without locking
+	if (size <= TCACHE_MAX_SIZE) {
+		size = ALIGN_TCACHE(size);
+		if (cache && !sampled) {
+			struct tcache_bin *bin =
+			        &cache->bins[size / TCACHE_SIZE_STEP];
+			void *ptr = tcache_pop(bin);
+			*zeroed = false;
+			if (ptr) {
+				count_usable(cache, usable_size(ptr), false);
+				return ptr;
+			}
+		}
+	}
+
+	// sizes that do not fit in a large block get a mapping of their own
+	if (size + sizeof(struct block) + sizeof(struct region) >
+	    block_sizes[LARGE_BLOCK]) {
+		new_region = huge_alloc(size, MIN_ALIGNMENT);
+	} else {
+		struct arena *arena = arena_get();
+		arena_lock(arena);
+		new_region = allocate_region(arena, size);
+		arena_tick(arena);
+		pthread_mutex_unlock(&arena->lock);
+
+		// the blocks of the arena reached their limit
+		if (!new_region) {
+			new_region = huge_alloc(size, MIN_ALIGNMENT);
+		}
+	}
+
+	if (!new_region) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// the memory is handed out, so it is not known to be zero anymore
+	*zeroed = new_region->zeroed;
+	new_region->zeroed = false;
+	count_usable(cache, new_region->size, false);
+	if (sampled) {
+		prof_sample(cache, new_region, requested);
+	}
+
+	return REGION2PTR(new_region);
+}
+
+void *
+malloc(size_t size)
+{
+	// bigger objects could not be indexed with a ptrdiff_t, the sizes
+	// in between are served by the huge path
+	if (size > PTRDIFF_MAX) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	bool zeroed;
+	void *ptr = allocate(size, &zeroed);
+	trace_record(TRACE_MALLOC, ptr, 0, size);
+	return ptr;
+}
+
+// allocates memory aligned to `alignment`, a power of two
+static void *
+allocate_aligned(size_t alignment, size_t size)
+{
+	// larger alignments would wrap the padded size of the region
+	if (size > PTRDIFF_MAX || alignment > REGION_MAX_SIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (alignment <= MIN_ALIGNMENT) {
+		bool zeroed;
+		void *ptr = allocate(size, &zeroed);
+		trace_record(TRACE_MEMALIGN, ptr, alignment, size);
+		return ptr;
+	}
+
+	struct region *new_region = NULL;
+	struct tcache *cache = tcache_get();
+	bool sampled = prof_sample_due(cache, size);
+
+	// slabs and the objects of a size class multiple of the alignment
+	// are aligned as well, up to the alignment of the slab header
+	size_t tiny_size = ALIGN_UP(size ? size : 1, alignment);
+	bool tiny = tiny_size <= SLAB_MAX_SIZE &&
+	            alignment <= SLAB_HEADER_SIZE && !sampled;
+	if (tiny) {
+		int size_class = SLAB_CLASS(tiny_size);
+		count_malloc(cache, SLAB_CLASS_SIZE(size_class));
+		void *object = allocate_tiny(cache, size_class);
+		if (object) {
+			count_usable(cache, usable_size(object), false);
+			trace_record(TRACE_MEMALIGN, object, alignment, size);
+			return object;
+		}
+	}
+
+	size_t requested = size;
+	if (size < min_size_region) {
+		size = min_size_region;
+	}
+	if (!tiny) {
+		count_malloc(cache, size);
+	}
+	size = ALIGN16(size);
+
+	// the region is taken with room for a leading region before
+	// the aligned payload, which goes back to the free regions
+	size_t padded = size + alignment + sizeof(struct region) + min_size_region;
+	if (padded + sizeof(struct block) + sizeof(struct region) <=
+	    block_sizes[LARGE_BLOCK]) {
+		struct arena *arena = arena_get();
+		arena_lock(arena);
+		new_region = allocate_region(arena, padded);
+		if (new_region) {
+			new_region = align_region(new_region, alignment, size);
+		}
+		arena_tick(arena);
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	if (!new_region) {
+		new_region = huge_alloc(size, alignment);
+	}
+	if (!new_region) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	new_region->zeroed = false;
+	count_usable(cache, new_region->size, false);
+	if (sampled) {
+		prof_sample(cache, new_region, requested);
+	}
+	void *ptr = REGION2PTR(new_region);
+	trace_record(TRACE_MEMALIGN, ptr, alignment, requested);
+	return ptr;
+}
+
+static bool
+is_power_of_two(size_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (!is_power_of_two(alignment) || alignment % sizeof(void *)) {
+		return EINVAL;
+	}
+
+	int saved_errno = errno;
+	void *ptr = allocate_aligned(alignment, size);
+	if (!ptr) {
+		errno = saved_errno;
+		return ENOMEM;
+	}
+	*memptr = ptr;
+	return 0;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	if (!is_power_of_two(alignment)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return allocate_aligned(alignment, size);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	if (!is_power_of_two(alignment)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return allocate_aligned(alignment, size);
+}
+
+void *
+valloc(size_t size)
+{
+	return allocate_aligned(getpagesize(), size);
+}
+
+void *
+pvalloc(size_t size)
+{
+	return allocate_aligned(getpagesize(), page_round(size));
+}
+
+// the usable size may be bigger than the requested one,
+// since sizes are rounded up to a size class or a multiple of 16 bytes
+size_t
+malloc_usable_size(void *ptr)
+{
+	if (!ptr) {
+		return 0;
+	}
+	if (is_slab_object(ptr)) {
+		return SLAB_CLASS_SIZE(PTR2SLAB(ptr)->size_class);
+	}
+	return PTR2REGION(ptr)->size;
+}
+
+// gives back an allocated pointer, through the thread cache if possible
+// a pointer of another arena goes to the remote free queue of its arena,
+// the headers of its block or slab tell which one it is
+static void
+deallocate(struct tcache *cache, void *ptr)
+{
+	// pointers that were not returned by malloc are ignored
+	size_t size = usable_size(ptr);
+	if (!size) {
+		return;
+	}
+	count_usable(cache, size, true);
+
+	// tiny objects are recognized by their address, they have no header
+	if (is_slab_object(ptr)) {
+		struct slab *slab = PTR2SLAB(ptr);
+		struct arena *arena = slab->arena;
+		if (arena != arena_get()) {
+			remote_free_push(arena, ptr);
+			return;
+		}
+		if (cache) {
+			tcache_push(cache,
+			            &cache->slab_bins[slab->size_class],
+			            ptr);
+			return;
+		}
+		// the header is released with the slab once it is empty
+		pthread_mutex_lock(&arena->lock);
+		slab_free(ptr);
+		pthread_mutex_unlock(&arena->lock);
+		return;
+	}
+
+	struct region *curr = PTR2REGION(ptr);
+	if (curr->sampled) {
+		prof_free(curr);
+	}
+
+	// huge regions do not belong to any arena
+	if (curr->magic_number == HUGE_MAGIC_NUMBER) {
+		huge_free(curr);
+		return;
+	}
+
+	// a region that is already free is ignored, like an invalid pointer,
+	// before it can reach a queue or a cache and be handed out twice
+	if (curr->free) {
+		return;
+	}
+	struct arena *arena = region_block(curr)->arena;
+	if (arena != arena_get()) {
+		remote_free_push(arena, ptr);
+		return;
+	}
+	if (cache && curr->size <= TCACHE_MAX_SIZE) {
+		tcache_push(cache,
+		            &cache->bins[curr->size / TCACHE_SIZE_STEP],
+		            ptr);
+		return;
+	}
+
+	// the region goes back to the arena that owns its block
+	pthread_mutex_lock(&arena->lock);
+	if (!curr->free) {
+		free_region(curr);
+	}
+	arena_tick(arena);
+	pthread_mutex_unlock(&arena->lock);
+}
+
+void
+free(void *ptr)
+{
+	// updates statistics
+	struct tcache *cache = tcache_get();
+	count_free(cache);
+
+	if (ptr) {
+		trace_record(TRACE_FREE, ptr, 0, 0);
+		deallocate(cache, ptr);
+	}
+}
+
+// frees a pointer whose size is known, `tiny_size` is the one its size
+// class was chosen by
+// a tiny object goes to the cache of its size class, which is found by the
+// size and not by the header of its slab, so that a cold object costs no
+// cache miss on the header, unless the header is needed to know its node
+static void
+deallocate_sized(void *ptr, size_t size, size_t tiny_size)
+{
+	struct tcache *cache = tcache_get();
+	count_free(cache);
+	if (!ptr) {
+		return;
+	}
+	trace_record(TRACE_FREE, ptr, 0, 0);
+
+	if (cache && amount_of_nodes == 1 && tiny_size <= SLAB_MAX_SIZE &&
+	    is_slab_object(ptr)) {
+		int size_class = SLAB_CLASS(tiny_size);
+#ifdef MALLOC_DEBUG
+		assert(PTR2SLAB(ptr)->size_class == size_class);
+#endif
+		count_usable(cache, SLAB_CLASS_SIZE(size_class), true);
+		tcache_push(cache, &cache->slab_bins[size_class], ptr);
+		return;
+	}
+#ifdef MALLOC_DEBUG
+	assert(size <= usable_size(ptr));
+#else
+	(void) size;
+#endif
+	deallocate(cache, ptr);
+}
+
+// `size` must be the one asked to malloc, calloc or realloc
+void
+free_sized(void *ptr, size_t size)
+{
+	deallocate_sized(ptr, size, size);
+}
+
+// `alignment` and `size` must be the ones asked to aligned_alloc
+void
+free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+#ifdef MALLOC_DEBUG
+	assert(((uintptr_t) ptr & (alignment - 1)) == 0);
+#endif
+	// the aligned tiny objects are in the class of the aligned size
+	size_t tiny_size = alignment <= MIN_ALIGNMENT
+	                           ? size
+	                           : ALIGN_UP(size ? size : 1, alignment);
+	deallocate_sized(ptr, size, tiny_size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(nmemb, size, &total) ||
+	    total > PTRDIFF_MAX) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// memory known to be zero only needs the links of the free index cleared
+	bool zeroed;
+	void *ptr = allocate(total, &zeroed);
+	if (ptr) {
+		memset(ptr,
+		       0,
+		       zeroed && total > FREE_REGION_LINKS_SIZE
+		               ? FREE_REGION_LINKS_SIZE
+		               : total);
+	} else {
+		errno = ENOMEM;
+	}
+	trace_record(TRACE_CALLOC, ptr, 0, total);
+	return ptr;
+}
+
+static void *
+reallocate(void *ptr, size_t size)
+{
+	bool zeroed;
+
+	if (size > PTRDIFF_MAX) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (!ptr && size != 0) {
+		return allocate(size, &zeroed);
+	} else if (ptr && size != 0) {
+		struct tcache *cache = tcache_get();
+		void *new_ptr;
+		size_t old_size;
 
-	struct block *block_act = block;
+		if (is_slab_object(ptr)) {
+			int size_class = PTR2SLAB(ptr)->size_class;
+			old_size = SLAB_CLASS_SIZE(size_class);
+			// an object stays in the class of its size, which is
+			// where free_sized looks for it
+			if (size <= old_size &&
+			    (int) SLAB_CLASS(size) == size_class) {
+				return ptr;
+			}
+		} else {
+			struct region *curr = PTR2REGION(ptr);
+			old_size = curr->size;
+			// keeps the minimum size and alignment used by malloc
+			size_t requested =
+			        size < min_size_region ? min_size_region : size;
+			size_t region_size = ALIGN16(requested);
+			bool growing = curr->size < region_size;
+			bool resized = false;
 
-	while (block_act) {
-		struct region *region = block_act->first_region;
-		while (region) {
-			if ((region->free) && (region->size >= region_size) &&
-			    ((region->size - region_size) < best_reg_dif)) {
-				best_reg_dif = region->size - region_size;
-				best_region = region;
+			if (curr->magic_number == HUGE_MAGIC_NUMBER) {
+				struct region *moved =
+				        huge_resize(curr, region_size);
+				if (moved) {
+					curr = moved;
+					resized = true;
+				}
+			} else {
+				struct arena *arena = region_block(curr)->arena;
+				pthread_mutex_lock(&arena->lock);
+				resized = resize_region(curr, region_size);
+				if (!resized && is_remappable(curr)) {
+					struct region *moved =
+					        remap_region(curr, region_size);
+					if (moved) {
+						curr = moved;
+						resized = true;
+					}
+				}
+				pthread_mutex_unlock(&arena->lock);
+			}
+
+			if (resized) {
+				if (growing) {
+					count_malloc(cache, requested);
+				}
+				count_usable(cache, old_size, true);
+				count_usable(cache, curr->size, false);
+				if (curr->sampled && REGION2PTR(curr) != ptr) {
+					prof_move(ptr, REGION2PTR(curr));
+				}
+				return REGION2PTR(curr);
 			}
-			region = region->next;
 		}
-		block_act = block_act->next;
+
+		// the content is moved to a new allocation
+		new_ptr = allocate(size, &zeroed);
+		if (new_ptr) {
+			memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+			deallocate(cache, ptr);
+		}
+		return new_ptr;
 	}
-	if (best_region) {
-		best_region->free = false;
+	struct tcache *cache = tcache_get();
+	count_free(cache);
+	if (ptr) {
+		deallocate(cache, ptr);
 	}
-	return best_region;
+	return NULL;
 }
 
-struct region *
-find_region_in_block_first_fit(struct block *block, size_t size)
+void *
+realloc(void *ptr, size_t size)
 {
-	struct block *block_act = block;
-	while (block_act) {
-		struct region *region = block_act->first_region;
-		while (region) {
-			if (region->free && region->size >= size) {
-				region->free = false;
-				return region;
-			}
-			region = region->next;
-		}
-		block_act = block_act->next;
+	void *new_ptr = reallocate(ptr, size);
+	trace_record(TRACE_REALLOC, new_ptr, (uintptr_t) ptr, size);
+	return new_ptr;
+}
+
+void *
+reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
 	}
-	return NULL;
+	return realloc(ptr, total);
 }
 
-// finds the next free region
-// that holds the requested size
-//
-static struct region *
-find_free_region(size_t size
-                 __attribute__((unused)))  // find_free_region(size_t size) tira warning
+// allocates the pointers of a batch one by one, returns how many it got
+static size_t
+allocate_each(size_t size, size_t n, void **ptrs)
 {
-	// struct region *region = NULL; tira warning aca
-#ifdef FIRST_FIT
-	struct region *region = NULL;
-	if (size < LITTLE_BLOCK_SIZE) {
-		region = find_region_in_block_first_fit(little_blocks, size);
+	size_t done = 0;
+	bool zeroed;
+	while (done < n && (ptrs[done] = allocate(size, &zeroed))) {
+		trace_record(TRACE_MALLOC, ptrs[done], 0, size);
+		done++;
+	}
+	return done;
+}
+
+// allocates `n` pointers of `size` bytes taking the arena lock once:
+// tiny sizes come from the slabs, the rest are cut one after the other
+// from a free region or a new block, so the search is done once per run
+// returns how many pointers were stored in `ptrs`, fewer than `n` only if
+// the memory ran out
+size_t
+malloc_batch(size_t size, size_t n, void **ptrs)
+{
+	if (size > PTRDIFF_MAX) {
+		errno = ENOMEM;
+		return 0;
 	}
-	if (!region && size < MID_BLOCK_SIZE) {
-		region = find_region_in_block_first_fit(mid_blocks, size);
+
+	// the same sizes as malloc, so that each pointer can be freed alone
+	size_t requested = size < min_size_region ? min_size_region : size;
+	size_t region_size = ALIGN16(requested);
+	if (region_size <= TCACHE_MAX_SIZE) {
+		region_size = ALIGN_TCACHE(region_size);
 	}
-	if (!region && size < LARGE_BLOCK_SIZE) {
-		region = find_region_in_block_first_fit(large_blocks, size);
+
+	// sampled allocations need a stack each and huge ones a mapping each
+	if (__atomic_load_n(&prof_ready, __ATOMIC_ACQUIRE) ||
+	    region_size + sizeof(struct block) + sizeof(struct region) >
+	            block_sizes[LARGE_BLOCK]) {
+		return allocate_each(size, n, ptrs);
 	}
-	return region;
-#endif
 
-#ifdef BEST_FIT
-	struct region *region = NULL;
-	if (size < LITTLE_BLOCK_SIZE) {
-		region = find_region_in_block_best_fit(little_blocks,
-		                                       size,
-		                                       LITTLE_BLOCK_SIZE);
+	struct tcache *cache = tcache_get();
+	struct arena *arena = arena_get();
+	size_t done = 0;
+	arena_lock(arena);
+	if (size <= SLAB_MAX_SIZE) {
+		int size_class = SLAB_CLASS(size);
+		while (done < n && (ptrs[done] = slab_alloc(arena, size_class))) {
+			done++;
+		}
 	}
-	if (!region && size < MID_BLOCK_SIZE) {
-		region = find_region_in_block_best_fit(mid_blocks,
-		                                       size,
-		                                       MID_BLOCK_SIZE);
+	// the slab zone may be exhausted, regions are used instead
+	size_t tiny = done;
+	while (done < n) {
+		size_t run = allocate_region_run(arena,
+		                                 region_size,
+		                                 n - done,
+		                                 ptrs + done);
+		if (!run) {
+			break;
+		}
+		done += run;
 	}
-	if (!region && size < LARGE_BLOCK_SIZE) {
-		region = find_region_in_block_best_fit(large_blocks,
-		                                       size,
-		                                       LARGE_BLOCK_SIZE);
+	arena_tick(arena);
+	pthread_mutex_unlock(&arena->lock);
+
+	if (tiny) {
+		size_t class_size = SLAB_CLASS_SIZE(SLAB_CLASS(size));
+		count_mallocs(cache, tiny, class_size);
+		count_usables(cache, tiny, class_size, false);
+	}
+	count_mallocs(cache, done - tiny, requested);
+	for (size_t i = 0; i < done; i++) {
+		if (i >= tiny) {
+			struct region *region = PTR2REGION(ptrs[i]);
+			region->zeroed = false;
+			count_usable(cache, region->size, false);
+		}
+		trace_record(TRACE_MALLOC, ptrs[i], 0, size);
 	}
-	return region;
-#endif
 
-	return NULL;
+	// the blocks of the arena reached their limit
+	return done + allocate_each(size, n - done, ptrs + done);
 }
 
+// frees `n` pointers, some of which may be NULL, keeping the lock of an
+// arena while the pointers that follow belong to it
+// the regions that follow each other in the array and in memory are
+// joined before being freed, so a run is coalesced with its neighbours
+// once, as the pointers of malloc_batch are
 void
-split_region(struct region *region, size_t size)
+free_batch(void **ptrs, size_t n)
 {
-	struct region *new_region = (void *) region + sizeof(struct region) + size;
-	new_region->free = true;
-	new_region->size = region->size - size - sizeof(struct region);
-	new_region->next = region->next;
-	new_region->prev = region;
-	new_region->magic_number = MAGIC_NUMBER;
-	region->next = new_region;
-	region->size = size;
-
-	amount_of_regions++;
-}
+	struct tcache *cache = tcache_get();
+	count_frees(cache, n);
 
-struct region *
-create_region_in_new_block(size_t block_size, struct block **block)
-{
-	amount_of_regions++;
+	struct arena *locked_arena = NULL;
+	for (size_t i = 0; i < n;) {
+		void *ptr = ptrs[i++];
+		if (!ptr) {
+			continue;
+		}
+		trace_record(TRACE_FREE, ptr, 0, 0);
+		// pointers that were not returned by malloc are ignored
+		size_t size = usable_size(ptr);
+		if (!size) {
+			continue;
+		}
+		count_usable(cache, size, true);
 
-	struct region *new_region =
-	        (void *) *block + sizeof(struct block) + sizeof(struct region);
-	new_region->free = false;
-	new_region->size =
-	        block_size - sizeof(struct block) - sizeof(struct region);
-	new_region->next = NULL;
-	new_region->prev = NULL;
-	new_region->magic_number = MAGIC_NUMBER;
+		if (is_slab_object(ptr)) {
+			locked_arena = arena_relock(locked_arena, PTR2SLAB(ptr)->arena);
+			slab_free(ptr);
+			continue;
+		}
 
-	(*block)->first_region = new_region;
+		struct region *region = PTR2REGION(ptr);
+		if (region->sampled) {
+			prof_free(region);
+		}
+		if (region->magic_number == HUGE_MAGIC_NUMBER) {
+			huge_free(region);
+			continue;
+		}
 
-	return new_region;
+		locked_arena =
+		        arena_relock(locked_arena, region_block(region)->arena);
+		if (region->free) {
+			continue;
+		}
+		struct region *next;
+		while (i < n && (next = region_next(region)) &&
+		       ptrs[i] == REGION2PTR(next) && !next->free) {
+			trace_record(TRACE_FREE, ptrs[i], 0, 0);
+			count_usable(cache, next->size, true);
+			if (next->sampled) {
+				prof_free(next);
+			}
+			join_next_region(region);
+			i++;
+		}
+		free_region(region);
+	}
+	if (locked_arena) {
+		arena_tick(locked_arena);
+		pthread_mutex_unlock(&locked_arena->lock);
+	}
 }
-//
-struct region *
-create_block_with_size(size_t block_size,
-                       struct block **block_list,
-                       struct block **last_block)
-{
-	struct block *new_block = mmap(NULL,
-	                               block_size,
-	                               PROT_WRITE | PROT_READ,
-	                               MAP_ANONYMOUS | MAP_PRIVATE,
-	                               0,
-	                               0);
 
-
-	if (new_block == MAP_FAILED) {
-		perror("ERROR: map failed");
-		return NULL;
+// maps blocks ahead of time for the node of the calling thread, so that
+// its arenas do not map them on the first allocations
+int
+malloc_reserve(size_t little, size_t mid, size_t large, int flags)
+{
+	size_t counts[BLOCK_TYPES] = { little, mid, large };
+	if (flags & ~(MALLOC_RESERVE_PREFAULT | MALLOC_RESERVE_MLOCK)) {
+		return EINVAL;
 	}
 
-	new_block->next = NULL;
-	if (!*block_list) {
-		new_block->previous = NULL;
-		*block_list = new_block;
-		*last_block = new_block;
-	} else {
-		new_block->previous = *last_block;
-		(*last_block)->next = new_block;
-		*last_block = new_block;
+	unsigned int node = arena_get()->node;
+	int error = 0;
+	for (int type = 0; type < BLOCK_TYPES && !error; type++) {
+		error = reserve_blocks(node, type, counts[type], flags);
 	}
-
-	struct region *new_region =
-	        create_region_in_new_block(block_size, &new_block);
-
-	return new_region;
+	return error;
 }
 
-struct region *
-create_block(size_t region_size)
-{
-	// size_t block_size;
-	// struct block *block_list;
-	// struct block *last_block; no se usan hay que sacarlas
-
-	if (region_size <= LITTLE_BLOCK_SIZE &&
-	    amount_of_little_blocks < MAX_LITTLE_BLOCKS) {
-		amount_of_little_blocks++;
-		return create_block_with_size(LITTLE_BLOCK_SIZE,
-		                              &little_blocks,
-		                              &last_little_block);
-	} else if (region_size <= MID_BLOCK_SIZE &&
-	           amount_of_mid_blocks < MAX_MID_BLOCKS) {
-		amount_of_mid_blocks++;
-		return create_block_with_size(MID_BLOCK_SIZE,
-		                              &mid_blocks,
-		                              &last_mid_block);
-	} else if (region_size <= LARGE_BLOCK_SIZE &&
-	           amount_of_large_blocks < MAX_LARGE_BLOCKS) {
-		amount_of_large_blocks++;
-		return create_block_with_size(LARGE_BLOCK_SIZE,
-		                              &large_blocks,
-		                              &last_large_block);
-	}
-	perror("can't create block too large");
-	return NULL;
+// adds up the counters of every thread
+static void
+sum_thread_stats(struct thread_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(stats, &exited_stats);
+	for (struct tcache *c = tcaches; c; c = c->next) {
+		stats_merge(stats, &c->stats);
+	}
+	pthread_mutex_unlock(&stats_lock);
 }
 
-void *
-malloc(size_t size)
+// the cache of the calling thread is flushed first,
+// so that the block and region counters describe the whole heap
+void
+get_stats(struct malloc_stats *stats)
 {
-	if ((int) size < 0) {
-		errno = ENOMEM;
-		return NULL;
+	struct tcache *cache = tcache_get();
+	if (cache) {
+		tcache_flush(cache);
 	}
 
-	struct region *new_region;
+	struct thread_stats threads;
+	sum_thread_stats(&threads);
+	stats->mallocs = threads.mallocs;
+	stats->frees = threads.frees;
+	stats->requested_memory = threads.requested_memory;
+	stats->allocated_bytes = threads.allocated > 0 ? threads.allocated : 0;
+	stats->mapped_bytes = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+	stats->peak_mapped_bytes =
+	        __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
 
-	// set minimum size (256 bytes)
-	if (size < MIN_SIZE_REGION) {
-		size = MIN_SIZE_REGION;
+	stats->amount_of_regions = 0;
+	stats->amount_of_little_blocks = 0;
+	stats->amount_of_mid_blocks = 0;
+	stats->amount_of_large_blocks = 0;
+	stats->amount_of_slabs = 0;
+	stats->amount_of_huge_blocks =
+	        __atomic_load_n(&amount_of_huge_blocks, __ATOMIC_RELAXED);
+	for (int i = 0; i < MAX_ARENAS; i++) {
+		struct arena *arena = &arenas[i];
+		arena_lock(arena);
+		stats->amount_of_regions += arena->amount_of_regions;
+		stats->amount_of_little_blocks +=
+		        arena->blocks[LITTLE_BLOCK].amount_of_blocks;
+		stats->amount_of_mid_blocks +=
+		        arena->blocks[MID_BLOCK].amount_of_blocks;
+		stats->amount_of_large_blocks +=
+		        arena->blocks[LARGE_BLOCK].amount_of_blocks;
+		stats->amount_of_slabs += arena->amount_of_slabs;
+		pthread_mutex_unlock(&arena->lock);
 	}
+}
 
-	// aligns to multiple of 4 bytes
-	size = ALIGN4(size);
+// statistics of a type of block over all the arenas: the empty blocks kept
+// to be reused, and the reserved ones, are mapped, but not part of the free
+// bytes
+//
+// fragmentation is the share of the free bytes that are not in the
+// largest free region, 0 when all the free bytes could serve a request
+struct block_stats {
+	uint64_t blocks;
+	uint64_t reserved;  // blocks not taken by an arena yet
+	uint64_t mapped;
+	uint64_t huge_pages;  // mapped bytes backed by huge pages
+	uint64_t resident;
+	uint64_t free;
+	uint64_t largest_free;
+	double fragmentation;
+};
 
-	// updates statistics
-	amount_of_mallocs++;
-	requested_memory += size;
+// statistics of the whole heap, read by mallctl and malloc_stats_print
+struct heap_stats {
+	struct thread_stats threads;
+	uint64_t allocated;
+	uint64_t mapped;
+	uint64_t mapped_peak;
+	uint64_t resident;
+	uint64_t regions;
+	uint64_t slabs;
+	uint64_t empty_slabs;
+	uint64_t remote_frees;
+	uint64_t purged;
+	uint64_t huge_blocks;
+	uint64_t huge_mapped;
+	uint64_t huge_cached;
+	struct block_stats blocks[BLOCK_TYPES];
 
-	// find available regions
-	new_region = find_free_region(size);
+	// bytes of the blocks and slabs of the arenas of each node, and of the
+	// blocks reserved for it
+	uint64_t nodes;
+	uint64_t node_mapped[MAX_NUMA_NODES];
+};
 
-	// should be created a new block
-	if (!new_region) {
-		new_region = create_block(size);
-		if (!new_region) {
-			errno = ENOMEM;
-			return NULL;
-		}
-	}
+static const char *block_type_names[BLOCK_TYPES] = {
+	[LITTLE_BLOCK] = "little",
+	[MID_BLOCK] = "mid",
+	[LARGE_BLOCK] = "large",
+};
 
-	// verify splitting
-	if (new_region->size - size >= sizeof(struct region) + MIN_SIZE_REGION) {
-		split_region(new_region, size);
-	}
+// bytes of a mapping backed by memory, pages purged with MADV_FREE
+// count until the kernel takes them
+static uint64_t
+resident_bytes(void *start, size_t size)
+{
+	unsigned char pages[256];
+	size_t page_size = getpagesize();
+	size_t chunk = sizeof(pages) * page_size;
+	uint64_t resident = 0;
 
-	return REGION2PTR(new_region);
+	for (size_t offset = 0; offset < size; offset += chunk) {
+		size_t len = size - offset < chunk ? size - offset : chunk;
+		if (mincore((char *) start + offset, len, pages) != 0) {
+			break;
+		}
+		for (size_t i = 0; i < (len + page_size - 1) / page_size; i++) {
+			resident += (pages[i] & 1) * page_size;
+		}
+	}
+	return resident;
 }
 
-void
-update_block_list(struct block *new_block_list, size_t block_size)
+// walks the blocks of a list, the arena lock must be held
+static void
+block_list_stats(struct block_list *list,
+                 struct block_stats *stats,
+                 bool resident)
 {
-	switch (block_size + sizeof(struct block) + sizeof(struct region)) {
-	case LITTLE_BLOCK_SIZE:
-		little_blocks = new_block_list;
-		break;
-	case MID_BLOCK_SIZE:
-		mid_blocks = new_block_list;
-		break;
-	case LARGE_BLOCK_SIZE:
-		large_blocks = new_block_list;
-		break;
+	for (struct block *block = list->first; block; block = block->next) {
+		stats->blocks++;
+		stats->mapped += block->size;
+		if (block->pages != PAGES_BASE) {
+			stats->huge_pages += block->size;
+		}
+		if (resident) {
+			stats->resident += resident_bytes(block, block->size);
+		}
+		for (struct region *region = FIRST_REGION(block); region;
+		     region = region_next(region)) {
+			if (region->free) {
+				stats->free += region->size;
+				if (region->size > stats->largest_free) {
+					stats->largest_free = region->size;
+				}
+			}
+		}
+	}
+	for (int i = 0; i < list->amount_of_empty_blocks; i++) {
+		struct block *block = list->empty_blocks[i];
+		stats->mapped += block->size;
+		if (block->pages != PAGES_BASE) {
+			stats->huge_pages += block->size;
+		}
+		if (resident) {
+			stats->resident += resident_bytes(block, block->size);
+		}
 	}
 }
 
-
-void
-delete_block(struct block *block, size_t size)
+// takes every lock in turn, the resident bytes are only measured if
+// asked, since every mapped page has to be looked up
+static void
+collect_heap_stats(struct heap_stats *stats, bool resident)
 {
-	// unique block in list
-	if (!block->previous && !block->next) {
-		update_block_list(NULL, size);
+	memset(stats, 0, sizeof(*stats));
+	sum_thread_stats(&stats->threads);
+	stats->allocated =
+	        stats->threads.allocated > 0 ? stats->threads.allocated : 0;
+	stats->mapped = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+	stats->mapped_peak = __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+	stats->huge_blocks =
+	        __atomic_load_n(&amount_of_huge_blocks, __ATOMIC_RELAXED);
+	stats->huge_mapped = __atomic_load_n(&huge_bytes, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&huge_lock);
+	for (int i = 0; i < HUGE_CACHE_SIZE; i++) {
+		stats->huge_cached += huge_cache[i] != NULL;
+	}
+	pthread_mutex_unlock(&huge_lock);
 
-		// block in middle of list
-	} else if (block->previous && block->next) {
-		block->previous->next = block->next;
-		block->next->previous = block->previous;
+	stats->nodes = amount_of_nodes;
+	for (int i = 0; i < MAX_ARENAS; i++) {
+		struct arena *arena = &arenas[i];
+		arena_lock(arena);
+		stats->regions += arena->amount_of_regions;
+		stats->slabs += arena->amount_of_slabs;
+		stats->empty_slabs += arena->amount_of_empty_slabs;
+		stats->remote_frees += arena->remote_frees;
+		stats->purged += arena->purged_bytes;
+		uint64_t *node_mapped = &stats->node_mapped[arena->node];
+		*node_mapped += (uint64_t) (arena->amount_of_slabs +
+		                            arena->amount_of_empty_slabs) *
+		                SLAB_SIZE;
+		for (int type = 0; type < BLOCK_TYPES; type++) {
+			uint64_t mapped = stats->blocks[type].mapped;
+			block_list_stats(&arena->blocks[type],
+			                 &stats->blocks[type],
+			                 resident);
+			*node_mapped += stats->blocks[type].mapped - mapped;
+		}
+		pthread_mutex_unlock(&arena->lock);
+	}
 
-		// first block
-	} else if (!block->previous && block->next) {
-		block->next->previous = NULL;
-		update_block_list(block->next, size);
+	pthread_mutex_lock(&reserve_lock);
+	for (unsigned int node = 0; node < amount_of_nodes; node++) {
+		for (int type = 0; type < BLOCK_TYPES; type++) {
+			struct block_stats *block_stats = &stats->blocks[type];
+			struct block *block = reserved_blocks[node][type];
+			for (; block; block = block->next) {
+				block_stats->reserved++;
+				block_stats->mapped += block->size;
+				stats->node_mapped[node] += block->size;
+				if (block->pages != PAGES_BASE) {
+					block_stats->huge_pages += block->size;
+				}
+				if (resident) {
+					block_stats->resident += resident_bytes(
+					        block, block->size);
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&reserve_lock);
 
-		// last block
-	} else if (block->previous && !block->next) {
-		block->previous->next = block->next;
+	for (int type = 0; type < BLOCK_TYPES; type++) {
+		struct block_stats *block_stats = &stats->blocks[type];
+		stats->resident += block_stats->resident;
+		if (block_stats->free) {
+			block_stats->fragmentation =
+			        1.0 - (double) block_stats->largest_free /
+			                      block_stats->free;
+		}
 	}
 
-	// testing
-	amount_of_regions--;
-	switch (size + sizeof(struct block) + sizeof(struct region)) {
-	case LITTLE_BLOCK_SIZE:
-		amount_of_little_blocks--;
-		break;
-	case MID_BLOCK_SIZE:
-		amount_of_mid_blocks--;
-		break;
-	case LARGE_BLOCK_SIZE:
-		amount_of_large_blocks--;
-		break;
+	if (resident) {
+		pthread_mutex_lock(&slab_zone_lock);
+		if (slab_zone) {
+			stats->resident += resident_bytes(slab_zone, slab_zone_used);
+		}
+		pthread_mutex_unlock(&slab_zone_lock);
+
+		pthread_mutex_lock(&huge_lock);
+		for (struct block *block = huge_blocks; block;
+		     block = block->next) {
+			stats->resident +=
+			        resident_bytes(huge_base(block), block->size);
+		}
+		for (int i = 0; i < HUGE_CACHE_SIZE; i++) {
+			if (huge_cache[i]) {
+				stats->resident += resident_bytes(
+				        huge_cache[i], huge_cache[i]->size);
+			}
+		}
+		pthread_mutex_unlock(&huge_lock);
 	}
-	munmap(block, size + sizeof(struct block) + sizeof(struct region));
 }
 
+struct ctl_value {
+	const char *name;
+	size_t offset;
+};
 
-void
-free(void *ptr)
-{
-	// updates statistics
-	amount_of_frees++;
+static const struct ctl_value heap_ctls[] = {
+	{ "allocated", offsetof(struct heap_stats, allocated) },
+	{ "mapped", offsetof(struct heap_stats, mapped) },
+	{ "mapped_peak", offsetof(struct heap_stats, mapped_peak) },
+	{ "resident", offsetof(struct heap_stats, resident) },
+	{ "regions", offsetof(struct heap_stats, regions) },
+	{ "slabs", offsetof(struct heap_stats, slabs) },
+	{ "empty_slabs", offsetof(struct heap_stats, empty_slabs) },
+	{ "remote_frees", offsetof(struct heap_stats, remote_frees) },
+	{ "purged", offsetof(struct heap_stats, purged) },
+	{ "huge.blocks", offsetof(struct heap_stats, huge_blocks) },
+	{ "huge.mapped", offsetof(struct heap_stats, huge_mapped) },
+	{ "huge.cached", offsetof(struct heap_stats, huge_cached) },
+	{ "nodes", offsetof(struct heap_stats, nodes) },
+	{ "mallocs", offsetof(struct heap_stats, threads.mallocs) },
+	{ "frees", offsetof(struct heap_stats, threads.frees) },
+	{ "requested_memory",
+	  offsetof(struct heap_stats, threads.requested_memory) },
+};
 
-	int *magic_number = (ptr - sizeof(int *));
+static const struct ctl_value block_ctls[] = {
+	{ "blocks", offsetof(struct block_stats, blocks) },
+	{ "reserved", offsetof(struct block_stats, reserved) },
+	{ "mapped", offsetof(struct block_stats, mapped) },
+	{ "huge_pages", offsetof(struct block_stats, huge_pages) },
+	{ "resident", offsetof(struct block_stats, resident) },
+	{ "free", offsetof(struct block_stats, free) },
+	{ "largest_free", offsetof(struct block_stats, largest_free) },
+};
 
-	if (*magic_number != MAGIC_NUMBER) {
-		return;
+// finds the value of a statistic in struct heap_stats,
+// `key` is its name without the "stats." prefix
+static bool
+ctl_lookup(const char *key, size_t *offset, bool *is_double)
+{
+	*is_double = false;
+	for (size_t i = 0; i < sizeof(heap_ctls) / sizeof(heap_ctls[0]); i++) {
+		if (!strcmp(key, heap_ctls[i].name)) {
+			*offset = heap_ctls[i].offset;
+			return true;
+		}
 	}
 
-	struct region *curr = PTR2REGION(ptr);
+	// stats.<type>.<value>
+	for (int type = 0; type < BLOCK_TYPES; type++) {
+		size_t len = strlen(block_type_names[type]);
+		if (strncmp(key, block_type_names[type], len) ||
+		    key[len] != '.') {
+			continue;
+		}
+		const char *value = key + len + 1;
+		size_t base = offsetof(struct heap_stats, blocks) +
+		              type * sizeof(struct block_stats);
+		if (!strcmp(value, "fragmentation")) {
+			*offset = base + offsetof(struct block_stats, fragmentation);
+			*is_double = true;
+			return true;
+		}
+		for (size_t i = 0; i < sizeof(block_ctls) / sizeof(block_ctls[0]);
+		     i++) {
+			if (!strcmp(value, block_ctls[i].name)) {
+				*offset = base + block_ctls[i].offset;
+				return true;
+			}
+		}
+		return false;
+	}
 
-	assert(curr->free == 0);
-	curr->free = true;
+	char *end;
 
-	// check if next region is free
-	struct region *next = curr->next;
+	// stats.nodes.<node>.mapped
+	const char *nodes = "nodes.";
+	if (!strncmp(key, nodes, strlen(nodes))) {
+		errno = 0;
+		unsigned long node = strtoul(key + strlen(nodes), &end, 10);
+		if (errno || end == key + strlen(nodes) ||
+		    node >= amount_of_nodes || strcmp(end, ".mapped")) {
+			return false;
+		}
+		*offset = offsetof(struct heap_stats, node_mapped) +
+		          node * sizeof(uint64_t);
+		return true;
+	}
 
-	if (next && next->free) {
-		curr->size = next->size + curr->size + sizeof(struct region);
-		curr->next = next->next;
-		amount_of_regions--;
+	// stats.size_classes.<class>.mallocs and stats.size_classes.<class>.frees
+	const char *prefix = "size_classes.";
+	if (strncmp(key, prefix, strlen(prefix))) {
+		return false;
 	}
-	// check if previous region is free
-	struct region *prev = curr->prev;
+	errno = 0;
+	unsigned long size_class = strtoul(key + strlen(prefix), &end, 10);
+	if (errno || end == key + strlen(prefix) ||
+	    size_class >= STATS_SIZE_CLASSES) {
+		return false;
+	}
+	if (!strcmp(end, ".mallocs")) {
+		*offset = offsetof(struct heap_stats, threads.class_mallocs) +
+		          size_class * sizeof(uint64_t);
+		return true;
+	}
+	if (!strcmp(end, ".frees")) {
+		*offset = offsetof(struct heap_stats, threads.class_frees) +
+		          size_class * sizeof(uint64_t);
+		return true;
+	}
+	return false;
+}
 
-	if (prev && prev->free) {
-		prev->size = prev->size + curr->size + sizeof(struct region);
-		prev->next = curr->next;
-		amount_of_regions--;
+// copies a value read with mallctl, or only its size if `oldp` is NULL
+static int
+ctl_read(void *oldp, size_t *oldlenp, const void *value, size_t size)
+{
+	if (!oldlenp) {
+		return oldp ? EINVAL : 0;
+	}
+	if (!oldp) {
+		*oldlenp = size;
+		return 0;
+	}
+	if (*oldlenp != size) {
+		return EINVAL;
+	}
+	memcpy(oldp, value, size);
+	return 0;
+}
+
+// settings in effect, read as opt.<option> with the name of the
+// MALLOC_CONF option that sets them and the type of their variable
+struct opt_ctl {
+	const char *name;
+	const void *value;
+	size_t size;
+};
+
+static const struct opt_ctl opt_ctls[] = {
+	{ "little_block_size", &block_sizes[LITTLE_BLOCK], sizeof(size_t) },
+	{ "mid_block_size", &block_sizes[MID_BLOCK], sizeof(size_t) },
+	{ "large_block_size", &block_sizes[LARGE_BLOCK], sizeof(size_t) },
+	{ "max_little_blocks", &max_blocks[LITTLE_BLOCK], sizeof(int) },
+	{ "max_mid_blocks", &max_blocks[MID_BLOCK], sizeof(int) },
+	{ "max_large_blocks", &max_blocks[LARGE_BLOCK], sizeof(int) },
+	{ "reserve_little", &reserve_counts[LITTLE_BLOCK], sizeof(size_t) },
+	{ "reserve_mid", &reserve_counts[MID_BLOCK], sizeof(size_t) },
+	{ "reserve_large", &reserve_counts[LARGE_BLOCK], sizeof(size_t) },
+	{ "min_region_size", &min_size_region, sizeof(size_t) },
+	{ "numa_nodes", &numa_nodes, sizeof(long) },
+	{ "decay_ms", &purge_decay_ms, sizeof(long) },
+	{ "background_thread", &background_thread, sizeof(bool) },
+	{ "prof_signal", &prof_signal, sizeof(int) },
+};
 
-		if (!prev->prev && !prev->next) {
-			delete_block((struct block *) ((void *) prev -
-			                               sizeof(struct block)),
-			             prev->size);
+// reads a setting, `key` is its name without the "opt." prefix, the fit
+// policies and the huge pages mode are read as their names
+static int
+opt_read(const char *key, void *oldp, size_t *oldlenp)
+{
+	pthread_once(&arenas_once, arenas_init);
+
+	const char *name = NULL;
+	if (!strcmp(key, "huge_pages")) {
+		name = huge_pages_names[huge_pages];
+	}
+	for (int type = 0; type < BLOCK_TYPES; type++) {
+		if (!strncmp(key, "fit_", 4) &&
+		    !strcmp(key + 4, block_type_names[type])) {
+			name = fit_names[fit_policies[type]];
 		}
+	}
+	if (name) {
+		return ctl_read(oldp, oldlenp, &name, sizeof(const char *));
+	}
 
-	} else if (!curr->prev && !curr->next) {
-		delete_block((struct block *) ((void *) curr -
-		                               sizeof(struct block)),
-		             curr->size);
+	for (size_t i = 0; i < sizeof(opt_ctls) / sizeof(opt_ctls[0]); i++) {
+		if (!strcmp(key, opt_ctls[i].name)) {
+			return ctl_read(oldp,
+			                oldlenp,
+			                opt_ctls[i].value,
+			                opt_ctls[i].size);
+		}
 	}
+	return ENOENT;
 }
 
-void *
-calloc(size_t nmemb, size_t size)
+// reads or writes a setting by name, in the way of sysctl:
+//   stats.*: read only, uint64_t values of the whole heap
+//   stats.<little|mid|large>.fragmentation: read only, a double
+//   stats.size_classes: read only, the number of size classes
+//   opt.<option>: read only, the value in effect of a MALLOC_CONF option,
+//   with the type of its variable, or a `const char *` for fit_<type> and
+//   huge_pages
+//   thread.tcache.flush: gives back the thread cache to the arenas
+//   heap.purge: gives back to the kernel the dirty pages of every arena,
+//   its empty slabs and the cached huge mappings
+//   thread.node: unsigned int, NUMA node of the arena of the thread,
+//   writing it moves the thread to an arena of that node
+//   prof.sample: size_t, average bytes between samples of the heap
+//   profile, writing it starts or stops (with 0) the profiler
+//   prof.dump: writes the heap profile to the `const char *` given, or to
+//   <prof_prefix>.<pid>.<n>.heap if it is NULL
+//   prof.dropped: read only, uint64_t samples not kept, the tables were full
+// returns 0, ENOENT for an unknown name, EINVAL for a wrong size and
+// EPERM when writing a value that can only be read
+// the statistics are collected on every call, without allocating
+int
+mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen)
 {
-	if ((int) nmemb < 0 || (int) size < 0) {
-		errno = ENOMEM;
-		return NULL;
+	if (!strcmp(name, "thread.tcache.flush")) {
+		if (oldp || newp || newlen) {
+			return EINVAL;
+		}
+		struct tcache *cache = tcache_get();
+		if (cache) {
+			tcache_flush(cache);
+		}
+		return 0;
 	}
-	void *ptr = malloc(nmemb * size);
-	if (ptr) {
-		memset(ptr, 0, nmemb * size);
-	} else {
-		errno = ENOMEM;
+	if (!strcmp(name, "heap.purge")) {
+		if (oldp || newp || newlen) {
+			return EINVAL;
+		}
+		for (int i = 0; i < MAX_ARENAS; i++) {
+			arena_lock(&arenas[i]);
+			arena_purge(&arenas[i]);
+			pthread_mutex_unlock(&arenas[i].lock);
+		}
+		decay_huge_cache(now_ms(), true);
+		return 0;
+	}
+	if (!strcmp(name, "thread.node")) {
+		unsigned int node = arena_get()->node;
+		int error = ctl_read(oldp, oldlenp, &node, sizeof(unsigned int));
+		if (error || !newp) {
+			return error;
+		}
+		if (newlen != sizeof(unsigned int) ||
+		    *(unsigned int *) newp >= amount_of_nodes) {
+			return EINVAL;
+		}
+		// the cached memory belongs to the node that is left
+		struct tcache *cache = tcache_get();
+		if (cache) {
+			tcache_flush(cache);
+		}
+		thread_arena = node_arena(*(unsigned int *) newp);
+		return 0;
 	}
-	return ptr;
-}
 
-void *
-realloc(void *ptr, size_t size)
-{
-	if ((int) size < 0) {
-		errno = ENOMEM;
-		return NULL;
+	if (!strcmp(name, "prof.sample")) {
+		size_t interval = prof_ready ? prof_interval : 0;
+		int error = ctl_read(oldp, oldlenp, &interval, sizeof(size_t));
+		if (error || !newp) {
+			return error;
+		}
+		if (newlen != sizeof(size_t)) {
+			return EINVAL;
+		}
+		return prof_enable(*(size_t *) newp) ? 0 : ENOMEM;
+	}
+	if (!strcmp(name, "prof.dropped")) {
+		if (newp || newlen) {
+			return EPERM;
+		}
+		pthread_mutex_lock(&prof_lock);
+		uint64_t dropped = prof_dropped;
+		pthread_mutex_unlock(&prof_lock);
+		return ctl_read(oldp, oldlenp, &dropped, sizeof(uint64_t));
+	}
+	if (!strcmp(name, "prof.dump")) {
+		if (oldp || (newp && newlen != sizeof(const char *))) {
+			return EINVAL;
+		}
+		pthread_mutex_lock(&prof_lock);
+		int error = prof_dump_locked(newp ? *(const char **) newp : NULL);
+		pthread_mutex_unlock(&prof_lock);
+		return error;
 	}
 
-	if (!ptr && size != 0) {
-		return malloc(size);
-	} else if (ptr && size != 0) {
-		struct region *curr = PTR2REGION(ptr);
-		if (curr->size > size) {
-			if (curr->size - size >=
-			    sizeof(struct region) + MIN_SIZE_REGION) {
-				split_region(curr, size);
-			}
+	const char *opt = "opt.";
+	if (!strncmp(name, opt, strlen(opt))) {
+		if (newp || newlen) {
+			return EPERM;
+		}
+		return opt_read(name + strlen(opt), oldp, oldlenp);
+	}
 
-			return REGION2PTR(curr);
-		} else {
-			void *new_ptr = malloc(size);
-			memcpy(new_ptr, ptr, curr->size);
-			return new_ptr;
+	const char *prefix = "stats.";
+	if (strncmp(name, prefix, strlen(prefix))) {
+		return ENOENT;
+	}
+	const char *key = name + strlen(prefix);
+	if (!strcmp(key, "size_classes")) {
+		uint64_t size_classes = STATS_SIZE_CLASSES;
+		if (newp || newlen) {
+			return EPERM;
 		}
+		return ctl_read(oldp, oldlenp, &size_classes, sizeof(uint64_t));
+	}
+
+	size_t offset;
+	bool is_double;
+	if (!ctl_lookup(key, &offset, &is_double)) {
+		return ENOENT;
+	}
+	if (newp || newlen) {
+		return EPERM;
+	}
+
+	struct heap_stats stats;
+	collect_heap_stats(&stats, strstr(key, "resident") != NULL);
+	return ctl_read(oldp,
+	                oldlenp,
+	                (char *) &stats + offset,
+	                is_double ? sizeof(double) : sizeof(uint64_t));
+}
+
+// formats a piece of the output of malloc_stats_print
+static void
+stats_write(void (*write_cb)(void *, const char *),
+            void *cbopaque,
+            const char *format,
+            ...)
+{
+	char line[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	if (write_cb) {
+		write_cb(cbopaque, line);
+	} else if (write(STDERR_FILENO, line, strlen(line)) < 0) {
+		// nothing else can be done
 	}
-	free(ptr);
-	return NULL;
 }
 
+// writes the statistics of the heap as text, or as a JSON object if `opts`
+// has a 'J', to `write_cb` or to stderr if it is NULL
+// the output is formatted in a buffer in the stack, nothing is allocated
 void
-get_stats(struct malloc_stats *stats)
+malloc_stats_print(void (*write_cb)(void *, const char *),
+                   void *cbopaque,
+                   const char *opts)
 {
-	stats->mallocs = amount_of_mallocs;
-	stats->frees = amount_of_frees;
-	stats->requested_memory = requested_memory;
-	stats->amount_of_regions = amount_of_regions;
-	stats->amount_of_little_blocks = amount_of_little_blocks;
-	stats->amount_of_mid_blocks = amount_of_mid_blocks;
-	stats->amount_of_large_blocks = amount_of_large_blocks;
+	struct heap_stats stats;
+	bool json = opts && strchr(opts, 'J');
+	collect_heap_stats(&stats, true);
+
+	if (json) {
+		stats_write(write_cb,
+		            cbopaque,
+		            "{\"allocated\": %lu, \"mapped\": %lu, "
+		            "\"mapped_peak\": %lu, \"resident\": %lu, "
+		            "\"mallocs\": %lu, \"frees\": %lu, "
+		            "\"requested_memory\": %lu, \"regions\": %lu, "
+		            "\"slabs\": %lu, \"empty_slabs\": %lu, "
+		            "\"remote_frees\": %lu, \"purged\": %lu, ",
+		            stats.allocated,
+		            stats.mapped,
+		            stats.mapped_peak,
+		            stats.resident,
+		            stats.threads.mallocs,
+		            stats.threads.frees,
+		            stats.threads.requested_memory,
+		            stats.regions,
+		            stats.slabs,
+		            stats.empty_slabs,
+		            stats.remote_frees,
+		            stats.purged);
+		stats_write(write_cb,
+		            cbopaque,
+		            "\"huge\": {\"blocks\": %lu, \"mapped\": %lu, "
+		            "\"cached\": %lu}, \"blocks\": {",
+		            stats.huge_blocks,
+		            stats.huge_mapped,
+		            stats.huge_cached);
+		for (int type = 0; type < BLOCK_TYPES; type++) {
+			struct block_stats *b = &stats.blocks[type];
+			stats_write(write_cb,
+			            cbopaque,
+			            "%s\"%s\": {\"blocks\": %lu, "
+			            "\"reserved\": %lu, \"mapped\": %lu, "
+			            "\"huge_pages\": %lu, "
+			            "\"resident\": %lu, \"free\": %lu, "
+			            "\"largest_free\": %lu, "
+			            "\"fragmentation\": %.3f}",
+			            type ? ", " : "",
+			            block_type_names[type],
+			            b->blocks,
+			            b->reserved,
+			            b->mapped,
+			            b->huge_pages,
+			            b->resident,
+			            b->free,
+			            b->largest_free,
+			            b->fragmentation);
+		}
+		stats_write(write_cb, cbopaque, "}, \"nodes\": [");
+		for (uint64_t node = 0; node < stats.nodes; node++) {
+			stats_write(write_cb,
+			            cbopaque,
+			            "%s{\"mapped\": %lu}",
+			            node ? ", " : "",
+			            stats.node_mapped[node]);
+		}
+		stats_write(write_cb, cbopaque, "], \"size_classes\": [");
+		bool first = true;
+		for (int i = 0; i < STATS_SIZE_CLASSES; i++) {
+			if (!stats.threads.class_mallocs[i]) {
+				continue;
+			}
+			stats_write(write_cb,
+			            cbopaque,
+			            "%s{\"size\": %lu, \"mallocs\": %lu, "
+			            "\"frees\": %lu}",
+			            first ? "" : ", ",
+			            1UL << i,
+			            stats.threads.class_mallocs[i],
+			            stats.threads.class_frees[i]);
+			first = false;
+		}
+		stats_write(write_cb, cbopaque, "]}\n");
+		return;
+	}
+
+	stats_write(write_cb,
+	            cbopaque,
+	            "allocated: %lu\nmapped: %lu (peak %lu)\nresident: %lu\n"
+	            "mallocs: %lu\nfrees: %lu\nrequested memory: %lu\n"
+	            "regions: %lu\nslabs: %lu (%lu empty)\nremote frees: %lu\n"
+	            "purged: %lu\nhuge blocks: %lu (%lu bytes), %lu cached\n",
+	            stats.allocated,
+	            stats.mapped,
+	            stats.mapped_peak,
+	            stats.resident,
+	            stats.threads.mallocs,
+	            stats.threads.frees,
+	            stats.threads.requested_memory,
+	            stats.regions,
+	            stats.slabs,
+	            stats.empty_slabs,
+	            stats.remote_frees,
+	            stats.purged,
+	            stats.huge_blocks,
+	            stats.huge_mapped,
+	            stats.huge_cached);
+	stats_write(write_cb,
+	            cbopaque,
+	            "%-8s %8s %8s %12s %12s %12s %12s %6s\n",
+	            "block",
+	            "blocks",
+	            "reserved",
+	            "mapped",
+	            "resident",
+	            "free",
+	            "largest free",
+	            "frag");
+	for (int type = 0; type < BLOCK_TYPES; type++) {
+		struct block_stats *b = &stats.blocks[type];
+		stats_write(write_cb,
+		            cbopaque,
+		            "%-8s %8lu %8lu %12lu %12lu %12lu %12lu %6.3f\n",
+		            block_type_names[type],
+		            b->blocks,
+		            b->reserved,
+		            b->mapped,
+		            b->resident,
+		            b->free,
+		            b->largest_free,
+		            b->fragmentation);
+	}
+	stats_write(write_cb, cbopaque, "%-8s %12s\n", "node", "mapped");
+	for (uint64_t node = 0; node < stats.nodes; node++) {
+		stats_write(write_cb,
+		            cbopaque,
+		            "%-8lu %12lu\n",
+		            node,
+		            stats.node_mapped[node]);
+	}
+	stats_write(write_cb,
+	            cbopaque,
+	            "%-12s %12s %12s %12s\n",
+	            "size up to",
+	            "mallocs",
+	            "frees",
+	            "live");
+	for (int i = 0; i < STATS_SIZE_CLASSES; i++) {
+		if (stats.threads.class_mallocs[i]) {
+			stats_write(write_cb,
+			            cbopaque,
+			            "%-12lu %12lu %12lu %12lu\n",
+			            1UL << i,
+			            stats.threads.class_mallocs[i],
+			            stats.threads.class_frees[i],
+			            stats.threads.class_mallocs[i] -
+			                    stats.threads.class_frees[i]);
+		}
+	}
 }
@@ -1,24 +1,71 @@
 #ifndef _MALLOC_H_
 #define _MALLOC_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct malloc_stats {
-	int mallocs;
-	int frees;
-	int requested_memory;
+	uint64_t mallocs;
+	uint64_t frees;
+	uint64_t requested_memory;
+	uint64_t allocated_bytes;
+	uint64_t mapped_bytes;
+	uint64_t peak_mapped_bytes;
 	int amount_of_regions;
 	int amount_of_little_blocks;
 	int amount_of_mid_blocks;
 	int amount_of_large_blocks;
+	int amount_of_slabs;
+	int amount_of_huge_blocks;
 };
 
 void *malloc(size_t size);
 
 void free(void *ptr);
 
+void free_sized(void *ptr, size_t size);
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
 void *calloc(size_t nmemb, size_t size);
 
 void *realloc(void *ptr, size_t size);
 
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+void *aligned_alloc(size_t alignment, size_t size);
+
+void *memalign(size_t alignment, size_t size);
+
+void *valloc(size_t size);
+
+void *pvalloc(size_t size);
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size);
+
+size_t malloc_usable_size(void *ptr);
+
+size_t malloc_batch(size_t size, size_t n, void **ptrs);
+
+void free_batch(void **ptrs, size_t n);
+
+// flags of malloc_reserve: the pages of the reserved blocks are faulted in
+// now, or locked in memory (which also faults them in)
+#define MALLOC_RESERVE_PREFAULT 1
+#define MALLOC_RESERVE_MLOCK 2
+
+// maps `little`, `mid` and `large` blocks for the NUMA node of the calling
+// thread, which its arenas take before mapping new ones
+// returns 0, EINVAL for unknown flags, or the error of the mmap or mlock
+// that failed, the blocks mapped until then stay reserved
+int malloc_reserve(size_t little, size_t mid, size_t large, int flags);
+
 void get_stats(struct malloc_stats *stats);
 
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
+
+void malloc_stats_print(void (*write_cb)(void *, const char *),
+                        void *cbopaque,
+                        const char *opts);
+
 #endif  // _MALLOC_H_
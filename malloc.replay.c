@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+// replays a trace written with MALLOC_TRACE_FILE against the allocator
+// linked into this program: glibc, or this allocator with
+// LD_PRELOAD=./libmalloc.so
+//
+// usage: ./malloc.replay trace [label]
+// the records of every thread are replayed in a single thread, in the order
+// of their times, and the result is printed as a JSON line
+
+// an entry of the table that maps the pointers of the trace to the ones
+// returned while replaying it
+struct pointer {
+	uint64_t traced;
+	void *replayed;
+	size_t size;
+};
+
+#define EMPTY 0
+#define DELETED 1
+
+static struct trace_record *records;
+static size_t amount_of_records;
+
+static struct pointer *pointers;
+static size_t table_mask;
+
+static size_t live_bytes = 0;
+static size_t peak_live_bytes = 0;
+static long skipped = 0;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// memory for the replay itself is mapped, not allocated
+static void *
+map(size_t size)
+{
+	void *ptr = mmap(NULL,
+	                 size,
+	                 PROT_READ | PROT_WRITE,
+	                 MAP_ANONYMOUS | MAP_PRIVATE,
+	                 -1,
+	                 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	// the pages are touched now, so they are not counted as heap
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+static long
+status_kb(const char *field)
+{
+	char buf[4096];
+	int fd = open("/proc/self/status", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		return -1;
+	}
+	buf[len] = '\0';
+
+	char *line = strstr(buf, field);
+	return line ? strtol(line + strlen(field) + 1, NULL, 10) : -1;
+}
+
+static void
+reset_peak_rss(void)
+{
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd >= 0) {
+		if (write(fd, "5", 1) < 0) {
+			perror("clear_refs");
+		}
+		close(fd);
+	}
+}
+
+static void
+load_trace(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct trace_header header;
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+	    header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+	    header.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	amount_of_records =
+	        (st.st_size - sizeof(header)) / sizeof(struct trace_record);
+	size_t size = amount_of_records * sizeof(struct trace_record);
+	records = map(size ? size : 1);
+	for (size_t done = 0; done < size;) {
+		ssize_t n = read(fd, (char *) records + done, size - done);
+		if (n <= 0) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+		done += n;
+	}
+	close(fd);
+}
+
+// the records of a thread are already in order, so the sort is stable
+// to keep the order of the ones with the same time
+static void
+sort_records(void)
+{
+	struct trace_record *tmp =
+	        map(amount_of_records * sizeof(struct trace_record) + 1);
+	for (size_t width = 1; width < amount_of_records; width *= 2) {
+		for (size_t lo = 0; lo < amount_of_records; lo += 2 * width) {
+			size_t mid = lo + width < amount_of_records
+			                     ? lo + width
+			                     : amount_of_records;
+			size_t hi = lo + 2 * width < amount_of_records
+			                    ? lo + 2 * width
+			                    : amount_of_records;
+			size_t i = lo, j = mid, k = lo;
+			while (i < mid && j < hi) {
+				tmp[k++] = records[j].time < records[i].time
+				                   ? records[j++]
+				                   : records[i++];
+			}
+			while (i < mid) {
+				tmp[k++] = records[i++];
+			}
+			while (j < hi) {
+				tmp[k++] = records[j++];
+			}
+		}
+		memcpy(records,
+		       tmp,
+		       amount_of_records * sizeof(struct trace_record));
+	}
+	munmap(tmp, amount_of_records * sizeof(struct trace_record) + 1);
+}
+
+static struct pointer *
+find_pointer(uint64_t traced)
+{
+	for (size_t i = (traced >> 4) & table_mask;; i = (i + 1) & table_mask) {
+		if (pointers[i].traced == traced) {
+			return &pointers[i];
+		}
+		if (pointers[i].traced == EMPTY) {
+			return NULL;
+		}
+	}
+}
+
+static void
+forget_pointer(struct pointer *pointer)
+{
+	live_bytes -= pointer->size;
+	pointer->traced = DELETED;
+}
+
+static void
+remember_pointer(uint64_t traced, void *replayed, size_t size)
+{
+	size_t i = (traced >> 4) & table_mask;
+	while (pointers[i].traced != EMPTY && pointers[i].traced != DELETED) {
+		i = (i + 1) & table_mask;
+	}
+	pointers[i].traced = traced;
+	pointers[i].replayed = replayed;
+	pointers[i].size = size;
+
+	// the pages are touched, as the traced program did
+	for (size_t offset = 0; offset < size; offset += 4096) {
+		((char *) replayed)[offset] = 1;
+	}
+
+	live_bytes += size;
+	if (live_bytes > peak_live_bytes) {
+		peak_live_bytes = live_bytes;
+	}
+}
+
+// a pointer of the trace that is returned again before the record of
+// its free is because of the order of the threads: it is freed first
+static void
+forget_reused(uint64_t traced)
+{
+	struct pointer *pointer = find_pointer(traced);
+	if (pointer) {
+		free(pointer->replayed);
+		forget_pointer(pointer);
+		skipped++;
+	}
+}
+
+// replays a record, returns the time spent in the allocator
+static uint64_t
+replay(struct trace_record *record)
+{
+	struct pointer *old = NULL;
+	void *ptr = NULL;
+	uint64_t start, end;
+
+	if (record->op == TRACE_FREE || record->op == TRACE_REALLOC) {
+		uint64_t traced = record->op == TRACE_FREE ? record->address
+		                                           : record->argument;
+		if (traced) {
+			old = find_pointer(traced);
+			if (!old) {
+				skipped++;
+				return 0;
+			}
+		}
+	} else if (!record->address) {
+		// failed in the traced program
+		return 0;
+	}
+
+	switch (record->op) {
+	case TRACE_MALLOC:
+		forget_reused(record->address);
+		start = now_ns();
+		ptr = malloc(record->size);
+		end = now_ns();
+		break;
+	case TRACE_CALLOC:
+		forget_reused(record->address);
+		start = now_ns();
+		ptr = calloc(1, record->size);
+		end = now_ns();
+		break;
+	case TRACE_MEMALIGN: {
+		size_t alignment = record->argument < sizeof(void *)
+		                           ? sizeof(void *)
+		                           : record->argument;
+		forget_reused(record->address);
+		start = now_ns();
+		if (posix_memalign(&ptr, alignment, record->size)) {
+			ptr = NULL;
+		}
+		end = now_ns();
+		break;
+	}
+	case TRACE_FREE:
+		start = now_ns();
+		free(old->replayed);
+		end = now_ns();
+		forget_pointer(old);
+		return end - start;
+	case TRACE_REALLOC:
+		if (!record->address && record->size) {
+			// failed in the traced program
+			return 0;
+		}
+		if (record->address && record->address != record->argument) {
+			forget_reused(record->address);
+		}
+		start = now_ns();
+		ptr = realloc(old ? old->replayed : NULL, record->size);
+		end = now_ns();
+		if (old && (ptr || !record->size)) {
+			forget_pointer(old);
+		}
+		break;
+	default:
+		skipped++;
+		return 0;
+	}
+
+	if (ptr && record->address) {
+		remember_pointer(record->address, ptr, record->size);
+	}
+	return end - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s trace [label]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *label = argc > 2 ? argv[2] : "default";
+
+	load_trace(argv[1]);
+	sort_records();
+
+	size_t table_size = 16;
+	while (table_size < 2 * amount_of_records) {
+		table_size *= 2;
+	}
+	table_mask = table_size - 1;
+	pointers = map(table_size * sizeof(struct pointer));
+
+	uint16_t threads = 0;
+	for (size_t i = 0; i < amount_of_records; i++) {
+		if (records[i].thread > threads) {
+			threads = records[i].thread;
+		}
+	}
+
+	// the memory used by the replay itself is not part of the heap
+	long base_rss = status_kb("VmRSS:");
+	reset_peak_rss();
+
+	uint64_t allocator_ns = 0;
+	for (size_t i = 0; i < amount_of_records; i++) {
+		allocator_ns += replay(&records[i]);
+	}
+
+	long peak_rss = status_kb("VmHWM:") - base_rss;
+	long final_rss = status_kb("VmRSS:") - base_rss;
+	long peak_live = peak_live_bytes / 1024;
+	double fragmentation =
+	        peak_rss > peak_live ? 1.0 - (double) peak_live / peak_rss : 0;
+
+	printf("{\"allocator\": \"%s\", \"trace\": \"%s\", \"records\": %zu, "
+	       "\"threads\": %u, \"skipped\": %ld, \"allocator_ms\": %.3f, "
+	       "\"ops_per_sec\": %.0f, \"peak_live_kb\": %ld, "
+	       "\"peak_rss_kb\": %ld, \"final_live_kb\": %zu, "
+	       "\"final_rss_kb\": %ld, \"fragmentation\": %.3f}\n",
+	       label,
+	       argv[1],
+	       amount_of_records,
+	       threads,
+	       skipped,
+	       allocator_ns / 1e6,
+	       allocator_ns ? amount_of_records / (allocator_ns / 1e9) : 0,
+	       peak_live,
+	       peak_rss,
+	       live_bytes / 1024,
+	       final_rss,
+	       fragmentation);
+	return 0;
+}
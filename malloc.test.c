@@ -3,10 +3,21 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "testlib.h"
 #include "malloc.h"
 
+// the default build has no fit policy and creates a block for every
+// region, so the tests of how free regions are reused need one
+#if defined(FIRST_FIT) || defined(BEST_FIT) || defined(ADDRESS_FIT) ||        \
+        defined(NEXT_FIT) || defined(TLSF)
+#define HAS_FIT_POLICY
+#endif
+
 static void
 successful_malloc_returns_non_null_pointer(void)
 {
@@ -88,9 +99,9 @@ minimum_size_of_requested_memory(void)
 
 	get_stats(&stats);
 
-	ASSERT_TRUE(
-	        "TEST 06 - amount of minimum requested memory should be 256",
-	        stats.requested_memory == 256);
+	ASSERT_TRUE("TEST 06 - amount of requested memory for a tiny object "
+	            "should be its size class (112)",
+	            stats.requested_memory == 112);
 }
 
 static void
@@ -323,18 +334,17 @@ test_correct_realloc_size_zero()
 	ASSERT_TRUE("TEST 20 - amount of requested_memory should be 1",
 	            stats.frees == 1);
 	ASSERT_TRUE("	* new variable should be NULL", !var);
-	free(ptr);
 }
 
 static void
 test_correct_realloc_in_another_variable()
 {
-	struct malloc_stats stats;
 	char *ptr = malloc(500);
+	strcpy(ptr, "content to keep");
+	// the region may move, so ptr is not used after realloc
 	char *var = realloc(ptr, 1000);
-	get_stats(&stats);
-	ASSERT_TRUE("TEST 21 - equal content in variables", !strcmp(ptr, var));
-	free(ptr);
+	ASSERT_TRUE("TEST 21 - equal content in variables",
+	            !strcmp(var, "content to keep"));
 	free(var);
 }
 
@@ -346,7 +356,6 @@ test_correct_realloc_in_smaller_region()
 	char *var = realloc(ptr, 200);
 	get_stats(&stats);
 	ASSERT_TRUE("TEST 22 - should be the same pointers", ptr == var);
-	free(ptr);
 	free(var);
 }
 
@@ -361,7 +370,6 @@ test_correct_realloc_in_bigger_region()
 	            stats.requested_memory == 3000);
 	ASSERT_TRUE("	* amount of 'malloc' should be 2", stats.mallocs == 2);
 	ASSERT_TRUE("	* amount of 'free' should be 0", stats.frees == 0);
-	free(ptr);
 	free(var);
 }
 
@@ -409,10 +417,1054 @@ test_errno_realloc()
 	ASSERT_TRUE("	* realloc errno should be ENOMEM", errno == ENOMEM);
 }
 
+static void
+test_free_regions_are_reused()
+{
+	struct malloc_stats stats;
+	char *vars[10];
+	for (int i = 0; i < 10; i++) {
+		vars[i] = malloc(1000);
+	}
+	for (int i = 0; i < 9; i++) {
+		free(vars[i]);
+	}
+	char *var = malloc(3000);
+	get_stats(&stats);
+#ifdef HAS_FIT_POLICY
+	ASSERT_TRUE("TEST 27 - freed regions should be reused before creating "
+	            "a new block",
+	            stats.amount_of_little_blocks == 1);
+	ASSERT_TRUE("	* amount of regions should be 4",
+	            stats.amount_of_regions == 4);
+#endif
+	free(var);
+	free(vars[9]);
+}
+
+static void *
+malloc_and_free_in_loop(void *arg)
+{
+	bool *corrupted = arg;
+	for (int i = 0; i < 1000; i++) {
+		char *var = malloc(500);
+		memset(var, i % 128, 500);
+		char *var2 = malloc(5000);
+		memset(var2, i % 128, 5000);
+		if (var[499] != i % 128 || var2[4999] != i % 128) {
+			*corrupted = true;
+		}
+		free(var);
+		free(var2);
+	}
+	return NULL;
+}
+
+static void
+test_concurrent_mallocs_and_frees()
+{
+	struct malloc_stats stats;
+	pthread_t threads[4];
+	bool corrupted = false;
+
+	for (int i = 0; i < 4; i++) {
+		pthread_create(&threads[i],
+		               NULL,
+		               malloc_and_free_in_loop,
+		               &corrupted);
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	get_stats(&stats);
+
+	ASSERT_TRUE("TEST 28 - concurrent mallocs should not corrupt memory",
+	            !corrupted);
+	ASSERT_TRUE("	* amount of mallocs should count every thread",
+	            stats.mallocs >= 8000);
+	ASSERT_TRUE("	* amount of frees should count every thread",
+	            stats.frees >= 8000);
+}
+
+static void
+test_thread_cache_reuses_small_regions()
+{
+	char *var = malloc(500);
+	free(var);
+	char *var2 = malloc(500);
+
+	ASSERT_TRUE("TEST 29 - a freed small region should be reused by the "
+	            "same thread",
+	            var == var2);
+	free(var2);
+}
+
+static void *
+malloc_in_another_thread(void *arg)
+{
+	struct malloc_stats *stats = arg;
+	char *var = malloc(5000);
+	get_stats(stats);
+	free(var);
+	return NULL;
+}
+
+static void
+test_threads_use_different_arenas()
+{
+	struct malloc_stats stats;
+	pthread_t thread;
+	char *var = malloc(5000);
+
+	pthread_create(&thread, NULL, malloc_in_another_thread, &stats);
+	pthread_join(thread, NULL);
+
+#ifdef HAS_FIT_POLICY
+	ASSERT_TRUE("TEST 30 - another thread should allocate from its own "
+	            "arena",
+	            stats.amount_of_little_blocks == 2);
+#endif
+	free(var);
+}
+
+static void
+test_tiny_objects_use_slabs()
+{
+	struct malloc_stats stats;
+	char *var = malloc(16);
+	char *var2 = malloc(16);
+	get_stats(&stats);
+
+	ASSERT_TRUE("TEST 31 - tiny objects should be contiguous, without "
+	            "headers",
+	            var2 == var + 16);
+	ASSERT_TRUE("	* amount of slabs should be 1",
+	            stats.amount_of_slabs == 1);
+	ASSERT_TRUE("	* amount of regions should be 0",
+	            stats.amount_of_regions == 0);
+
+	free(var);
+	free(var2);
+	get_stats(&stats);
+	ASSERT_TRUE("	* amount of slabs should be 0 after freeing them",
+	            stats.amount_of_slabs == 0);
+}
+
+static void
+test_realloc_grows_in_place()
+{
+	struct malloc_stats stats;
+	char *var = malloc(2000);
+	char *var2 = realloc(var, 4000);
+	get_stats(&stats);
+
+	ASSERT_TRUE("TEST 32 - realloc should grow into the next free region",
+	            var2 == var);
+	ASSERT_TRUE("	* amount of regions should be 2",
+	            stats.amount_of_regions == 2);
+	free(var2);
+}
+
+static void
+test_realloc_shrink_joins_next_free_region()
+{
+	struct malloc_stats stats;
+	char *var = malloc(4000);
+	var = realloc(var, 2000);
+	get_stats(&stats);
+
+	ASSERT_TRUE("TEST 33 - the tail of a shrunk region should be joined "
+	            "with the next free region",
+	            stats.amount_of_regions == 2);
+	free(var);
+}
+
+static void
+test_realloc_remaps_large_regions()
+{
+	struct malloc_stats stats;
+	size_t size = 20 * 1024 * 1024;
+	char *var = malloc(size);
+	memset(var, 'a', size);
+	var = realloc(var, 2 * size);
+	get_stats(&stats);
+
+	ASSERT_TRUE("TEST 34 - realloc should grow a large region beyond its "
+	            "block",
+	            var != NULL && var[0] == 'a' && var[size - 1] == 'a');
+	ASSERT_TRUE("	* amount of large blocks should be 1",
+	            stats.amount_of_large_blocks == 1);
+	free(var);
+}
+
+static void
+test_huge_regions_have_their_own_mapping()
+{
+	struct malloc_stats stats;
+	size_t size = 40 * 1024 * 1024;
+	char *var = malloc(size);
+	memset(var, 'a', size);
+	get_stats(&stats);
+
+	ASSERT_TRUE("TEST 35 - a region bigger than a large block should be "
+	            "allocated",
+	            var != NULL && var[size - 1] == 'a');
+	ASSERT_TRUE("	* amount of huge blocks should be 1",
+	            stats.amount_of_huge_blocks == 1);
+	ASSERT_TRUE("	* amount of large blocks should be 0",
+	            stats.amount_of_large_blocks == 0);
+
+	free(var);
+	get_stats(&stats);
+	ASSERT_TRUE("	* amount of huge blocks should be 0 after free",
+	            stats.amount_of_huge_blocks == 0);
+}
+
+static void
+test_huge_regions_after_max_large_blocks()
+{
+	struct malloc_stats stats;
+	char *vars[26];
+	for (int i = 0; i < 26; i++) {
+		vars[i] = malloc(20 * 1024 * 1024);
+	}
+	get_stats(&stats);
+
+	ASSERT_TRUE("TEST 36 - allocations over the large block limit should "
+	            "be huge regions",
+	            vars[25] != NULL && stats.amount_of_large_blocks == 25 &&
+	                    stats.amount_of_huge_blocks == 1);
+
+	for (int i = 0; i < 26; i++) {
+		free(vars[i]);
+	}
+}
+
+static void
+test_empty_blocks_are_reused()
+{
+	struct malloc_stats stats;
+	char *var = malloc(2000);
+	var[1000] = 'a';
+	free(var);
+	get_stats(&stats);
+
+	ASSERT_TRUE("TEST 37 - an empty block should not be counted",
+	            stats.amount_of_little_blocks == 0);
+
+	char *var2 = malloc(2000);
+	ASSERT_TRUE("	* the empty block should be reused without mapping it "
+	            "again",
+	            var2 == var && var2[1000] == 'a');
+	free(var2);
+}
+
+static void
+test_calloc_overflow()
+{
+	// volatile, so that the compiler does not warn about the overflow
+	volatile size_t nmemb = 1UL << 20;
+	volatile size_t size = 1UL << 45;
+	errno = 0;
+	char *var = calloc(nmemb, size);
+
+	ASSERT_TRUE("TEST 38 - calloc should fail when nmemb * size overflows",
+	            var == NULL);
+	ASSERT_TRUE("	* calloc errno should be ENOMEM", errno == ENOMEM);
+}
+
+static void
+test_calloc_clears_reused_memory()
+{
+	char *var = malloc(3000);
+	memset(var, 'a', 3000);
+	free(var);
+
+	char *var3 = calloc(1, 3000);
+	bool zero = true;
+	for (int i = 0; i < 3000; i++) {
+		zero = zero && var3[i] == 0;
+	}
+	ASSERT_TRUE("TEST 39 - calloc should clear the memory of a reused "
+	            "region",
+	            var3 == var && zero);
+	free(var3);
+}
+
+static void
+test_pointers_are_aligned_to_16_bytes()
+{
+	char *var = malloc(1001);
+	char *var2 = malloc(1001);
+	char *var3 = malloc(24);
+	char *var4 = malloc(100000);
+
+	ASSERT_TRUE("TEST 40 - pointers should be aligned to 16 bytes",
+	            (uintptr_t) var % 16 == 0 && (uintptr_t) var2 % 16 == 0 &&
+	                    (uintptr_t) var3 % 16 == 0 &&
+	                    (uintptr_t) var4 % 16 == 0);
+	free(var);
+	free(var2);
+	free(var3);
+	free(var4);
+}
+
+static void
+test_aligned_allocations()
+{
+	void *var = NULL;
+	int result = posix_memalign(&var, 64, 1000);
+	char *var2 = aligned_alloc(4096, 5000);
+	char *var3 = memalign(256, 40);
+	char *var4 = valloc(100);
+	void *var5 = NULL;
+	int result2 = posix_memalign(&var5, 1 << 21, 40 * 1024 * 1024);
+
+	ASSERT_TRUE("TEST 41 - posix_memalign should align to 64 bytes",
+	            result == 0 && (uintptr_t) var % 64 == 0);
+	ASSERT_TRUE("	* aligned_alloc should align to 4096 bytes",
+	            (uintptr_t) var2 % 4096 == 0);
+	ASSERT_TRUE("	* memalign should align to 256 bytes",
+	            (uintptr_t) var3 % 256 == 0);
+	ASSERT_TRUE("	* valloc should align to a page",
+	            (uintptr_t) var4 % getpagesize() == 0);
+	ASSERT_TRUE("	* huge regions should be aligned as well",
+	            result2 == 0 && (uintptr_t) var5 % (1 << 21) == 0);
+	ASSERT_TRUE("	* posix_memalign should fail with an invalid alignment",
+	            posix_memalign(&var, 24, 1000) == EINVAL);
+
+	free(var);
+	free(var2);
+	free(var3);
+	free(var4);
+	free(var5);
+}
+
+static void
+test_malloc_usable_size()
+{
+	char *var = malloc(1000);
+	char *var2 = malloc(20);
+
+	ASSERT_TRUE("TEST 42 - usable size should hold the requested size",
+	            malloc_usable_size(var) >= 1000 &&
+	                    malloc_usable_size(var2) == 32);
+	free(var);
+	free(var2);
+}
+
+static void
+test_region_headers_are_compact()
+{
+	char *var = malloc(2000);
+	char *var2 = malloc(2000);
+
+#ifdef HAS_FIT_POLICY
+	ASSERT_TRUE("TEST 43 - a region header should take 16 bytes",
+	            var2 - var == 2000 + 16);
+#endif
+	free(var);
+	free(var2);
+}
+
+static void
+test_reallocarray()
+{
+	char *var = reallocarray(NULL, 100, 10);
+	volatile size_t huge_count = SIZE_MAX / 2;
+	char *var2 = reallocarray(NULL, huge_count, 4);
+	int error = errno;
+
+	ASSERT_TRUE("TEST 44 - reallocarray should fail on overflow",
+	            var != NULL && malloc_usable_size(var) >= 1000 &&
+	                    var2 == NULL && error == ENOMEM);
+	free(var);
+}
+
+static volatile bool stop_allocating;
+
+static void *
+allocate_until_stopped(void *arg __attribute__((unused)))
+{
+	while (!stop_allocating) {
+		free(malloc(5000));
+	}
+	return NULL;
+}
+
+static void
+test_fork_while_other_thread_allocates()
+{
+	pthread_t thread;
+	bool children_ok = true;
+
+	pthread_create(&thread, NULL, allocate_until_stopped, NULL);
+	for (int i = 0; i < 50 && children_ok; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			free(malloc(5000));
+			_exit(0);
+		}
+		int status;
+		children_ok = waitpid(pid, &status, 0) == pid &&
+		              WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+	stop_allocating = true;
+	pthread_join(thread, NULL);
+
+	ASSERT_TRUE("TEST 45 - a child forked while another thread allocates "
+	            "should be able to allocate",
+	            children_ok);
+}
+
+static uint64_t
+read_stat(const char *name)
+{
+	uint64_t value = 0;
+	size_t len = sizeof(value);
+	mallctl(name, &value, &len, NULL, 0);
+	return value;
+}
+
+static void
+test_mallctl_counts_allocated_bytes()
+{
+	uint64_t before = read_stat("stats.allocated");
+	char *var = malloc(1000);
+	uint64_t during = read_stat("stats.allocated");
+	size_t usable = malloc_usable_size(var);
+	free(var);
+	uint64_t after = read_stat("stats.allocated");
+	uint64_t value;
+	size_t len = sizeof(value);
+
+	ASSERT_TRUE("TEST 46 - mallctl should count the allocated bytes",
+	            during - before == usable && after == before &&
+	                    read_stat("stats.mapped") >= during &&
+	                    mallctl("stats.unknown", &value, &len, NULL, 0) ==
+	                            ENOENT &&
+	                    mallctl("stats.mapped", NULL, NULL, &value, len) ==
+	                            EPERM);
+}
+
+static void
+append_output(void *output, const char *text)
+{
+	strncat(output, text, 4096 - strlen(output) - 1);
+}
+
+static void
+test_stats_report_fragmentation()
+{
+	char *vars[8];
+	for (int i = 0; i < 8; i++) {
+		vars[i] = malloc(1000);
+	}
+	// leaves free holes between allocated regions
+	for (int i = 0; i < 8; i += 2) {
+		free(vars[i]);
+	}
+	mallctl("thread.tcache.flush", NULL, NULL, NULL, 0);
+
+	double fragmentation = 0;
+	size_t len = sizeof(fragmentation);
+	mallctl("stats.little.fragmentation", &fragmentation, &len, NULL, 0);
+	static char output[4096];
+	malloc_stats_print(append_output, output, "J");
+
+	ASSERT_TRUE("TEST 47 - stats should report the fragmentation of the "
+	            "blocks",
+	            fragmentation > 0 && fragmentation < 1 &&
+	                    strstr(output, "\"fragmentation\"") != NULL &&
+	                    read_stat("stats.resident") > 0);
+	for (int i = 1; i < 8; i += 2) {
+		free(vars[i]);
+	}
+}
+
+static void
+test_heap_profile_tracks_live_samples()
+{
+	size_t interval = 1;
+	char *vars[10];
+	const char *path = "/tmp/malloc.test.heap";
+	char profile[256] = "";
+
+	mallctl("prof.sample", NULL, NULL, &interval, sizeof(interval));
+	for (int i = 0; i < 10; i++) {
+		vars[i] = malloc(100);
+	}
+	for (int i = 0; i < 5; i++) {
+		free(vars[i]);
+	}
+	int error = mallctl("prof.dump", NULL, NULL, &path, sizeof(path));
+
+	FILE *file = fopen(path, "r");
+	if (file) {
+		if (!fgets(profile, sizeof(profile), file)) {
+			profile[0] = '\0';
+		}
+		fclose(file);
+	}
+	unlink(path);
+
+	unsigned long live = 0, allocated = 0;
+	sscanf(profile, "heap profile: %lu: %*u [%lu:", &live, &allocated);
+	ASSERT_TRUE("TEST 48 - the heap profile should have the live samples",
+	            error == 0 && strstr(profile, "@ heap_v2/1") != NULL &&
+	                    live >= 5 && allocated >= 10);
+	for (int i = 5; i < 10; i++) {
+		free(vars[i]);
+	}
+}
+
+static void
+test_batch_allocates_and_frees_runs()
+{
+	void *regions[100], *objects[100];
+	struct malloc_stats before, after;
+	get_stats(&before);
+
+	size_t got = malloc_batch(300, 100, regions) +
+	             malloc_batch(32, 100, objects);
+	bool sorted = true;
+	for (int i = 0; i < 100; i++) {
+		memset(regions[i], i, 300);
+		memset(objects[i], i, 32);
+		// the regions of a run are cut one after the other
+		if (i && (char *) regions[i] < (char *) regions[i - 1] + 300) {
+			sorted = false;
+		}
+	}
+	bool written = true;
+	for (int i = 0; i < 100; i++) {
+		written &= ((unsigned char *) regions[i])[299] == i &&
+		           ((unsigned char *) objects[i])[31] == i;
+	}
+	free_batch(regions, 100);
+	free_batch(objects, 100);
+	get_stats(&after);
+
+	ASSERT_TRUE("TEST 49 - a batch should be allocated and freed at once",
+	            got == 200 && sorted && written &&
+	                    after.amount_of_regions == before.amount_of_regions &&
+	                    after.allocated_bytes == before.allocated_bytes &&
+	                    after.mallocs - before.mallocs == 200 &&
+	                    after.frees - before.frees == 200);
+}
+
+static void
+test_sized_free_reuses_size_class()
+{
+	struct malloc_stats before, after;
+	get_stats(&before);
+
+	char *tiny = malloc(40);
+	free_sized(tiny, 40);
+	char *again = malloc(40);
+	char *aligned = aligned_alloc(64, 128);
+	free_aligned_sized(aligned, 64, 128);
+	char *aligned_again = aligned_alloc(64, 128);
+	// a shrunk object moves to the class of its new size
+	char *shrunk = realloc(malloc(200), 20);
+	char *region = malloc(2000);
+	free_sized(region, 2000);
+
+	bool reused = again == tiny && aligned_again == aligned &&
+	              malloc_usable_size(shrunk) == 32;
+	free_sized(again, 40);
+	free_aligned_sized(aligned_again, 64, 128);
+	free_sized(shrunk, 20);
+	get_stats(&after);
+
+	ASSERT_TRUE("TEST 50 - free_sized should give tiny objects back to "
+	            "their size class",
+	            reused && after.allocated_bytes == before.allocated_bytes &&
+	                    after.frees - before.frees == 6);
+}
+
+static void
+test_numa_nodes_report_their_blocks()
+{
+	char *var = malloc(1000);
+	uint64_t nodes = read_stat("stats.nodes");
+	unsigned int node = 0;
+	size_t len = sizeof(node);
+	int read = mallctl("thread.node", &node, &len, NULL, 0);
+	unsigned int other = nodes;
+	// a thread can only be moved to a node that exists
+	int moved = mallctl("thread.node", NULL, NULL, &other, sizeof(other));
+
+	char name[64];
+	snprintf(name, sizeof(name), "stats.nodes.%u.mapped", node);
+	uint64_t mapped = read_stat(name);
+	snprintf(name, sizeof(name), "stats.nodes.%lu.mapped", nodes);
+	uint64_t value;
+	size_t value_len = sizeof(value);
+
+	ASSERT_TRUE("TEST 51 - the arena of a thread should be on a NUMA node "
+	            "with its blocks mapped",
+	            nodes >= 1 && read == 0 && node < nodes && moved == EINVAL &&
+	                    mapped > 0 && mapped <= read_stat("stats.mapped") &&
+	                    mallctl(name, &value, &value_len, NULL, 0) == ENOENT);
+	free(var);
+}
+
+static void *
+free_in_another_thread(void *arg)
+{
+	char **vars = arg;
+	for (int i = 0; i < 4; i++) {
+		free(vars[i]);
+	}
+	return NULL;
+}
+
+static void
+test_remote_frees_go_back_to_their_arena()
+{
+	char *vars[4] = { malloc(40), malloc(100), malloc(2000), malloc(50000) };
+	uint64_t before = read_stat("stats.remote_frees");
+	pthread_t thread;
+
+	pthread_create(&thread, NULL, free_in_another_thread, vars);
+	pthread_join(thread, NULL);
+	// the next slow path of the owner takes them out of the queue, so the
+	// tiny object is back in its slab
+	char *again = malloc(40);
+
+	ASSERT_TRUE("TEST 52 - pointers freed by another thread should go back "
+	            "to the arena that owns them",
+	            again == vars[0] &&
+	                    read_stat("stats.remote_frees") - before == 4);
+	free(again);
+}
+
+static void
+test_reserved_blocks_are_taken_before_mapping()
+{
+	uint64_t reserved = read_stat("stats.mid.reserved");
+	uint64_t resident = read_stat("stats.mid.resident");
+	int invalid = malloc_reserve(0, 1, 0, 4);
+	int error = malloc_reserve(0, 1, 0, MALLOC_RESERVE_PREFAULT);
+	uint64_t reserved_after = read_stat("stats.mid.reserved");
+	uint64_t resident_after = read_stat("stats.mid.resident");
+	uint64_t mapped = read_stat("stats.mapped");
+	// too big for a little block, so it takes the reserved mid block
+	char *var = malloc(600 * 1024);
+
+	ASSERT_TRUE("TEST 53 - reserved blocks should be prefaulted and taken "
+	            "before mapping new ones",
+	            invalid == EINVAL && error == 0 &&
+	                    reserved_after == reserved + 1 &&
+	                    resident_after - resident >= 1024 * 1024 &&
+	                    read_stat("stats.mid.reserved") == reserved &&
+	                    read_stat("stats.mapped") == mapped);
+	free(var);
+}
+
+static void
+test_sizes_between_2_and_4_gib_are_served()
+{
+	size_t size = 3UL * 1024 * 1024 * 1024;
+	// the pages are never touched, so nothing but the mapping is needed
+	char *var = malloc(size);
+	char *grown = realloc(NULL, size);
+	void *aligned = NULL;
+	int error = posix_memalign(&aligned, 4096, size);
+	char *zeroed = calloc(3, size / 3);
+
+	ASSERT_TRUE("TEST 54 - requests between 2 and 4 GiB should be served "
+	            "by the huge path",
+	            var && grown && !error && aligned && zeroed &&
+	                    malloc_usable_size(var) >= size);
+	free(var);
+	free(grown);
+	free(aligned);
+	free(zeroed);
+}
+
+static void
+test_regions_freed_twice_are_not_handed_out_twice()
+{
+	char *before = malloc(500);
+	// volatile, so that the compiler does not see the second free
+	char *volatile var = malloc(500);
+	char *after = malloc(500);
+
+	free(var);
+	mallctl("thread.tcache.flush", NULL, NULL, NULL, 0);
+	// the region is already back in its arena, not in the cache
+	free(var);
+	char *first = malloc(500);
+	char *second = malloc(500);
+
+	ASSERT_TRUE("TEST 55 - a region freed twice should not be handed out "
+	            "twice",
+	            first != second);
+	free(before);
+	free(after);
+	free(first);
+	free(second);
+}
+
+static void
+test_regions_of_4_gib_shrink_into_the_free_index()
+{
+	size_t size = 4UL * 1024 * 1024 * 1024 + 64 * 1024 * 1024;
+	char *var = malloc(20 * 1024 * 1024);
+	var[0] = 'x';
+	// a large block grows with mremap, the pages are never touched
+	char *grown = realloc(var, size);
+	// the tail of more than 4 GiB goes back to the free index
+	char *shrunk = grown ? realloc(grown, 1024 * 1024) : NULL;
+	char *other = malloc(2 * 1024 * 1024);
+
+	ASSERT_TRUE("TEST 56 - a region grown past 4 GiB should shrink and "
+	            "leave its tail free",
+	            grown && shrunk && shrunk[0] == 'x' && other);
+	free(shrunk ? shrunk : grown);
+	free(other);
+}
+
+static void
+test_alignments_past_the_region_size_fail()
+{
+	void *var = NULL;
+	int result = posix_memalign(&var, 1UL << 63, 16);
+	errno = 0;
+	void *var2 = aligned_alloc(1UL << 62, (1UL << 62) + 64);
+	int error = errno;
+
+	ASSERT_TRUE("TEST 57 - alignments that do not fit in a region should "
+	            "fail with ENOMEM",
+	            result == ENOMEM && !var && !var2 && error == ENOMEM);
+}
+
+static void
+test_free_pages_are_purged_on_demand()
+{
+	size_t size = 8 * 1024 * 1024;
+	mallctl("heap.purge", NULL, NULL, NULL, 0);
+	uint64_t before = read_stat("stats.purged");
+	char *var = malloc(size);
+	memset(var, 'x', size);
+	// the tail goes back to the block as a dirty free region
+	char *shrunk = realloc(var, 1024 * 1024);
+	uint64_t kept = read_stat("stats.purged") - before;
+	int error = mallctl("heap.purge", NULL, NULL, NULL, 0);
+	uint64_t purged = read_stat("stats.purged") - before;
+
+	ASSERT_TRUE("TEST 58 - free pages should stay dirty until they decay "
+	            "or are purged",
+	            shrunk == var && kept == 0 && !error &&
+	                    purged >= size - 2 * 1024 * 1024);
+	free(shrunk);
+}
+
+static void
+test_huge_regions_are_cached_then_released()
+{
+	size_t size = 64 * 1024 * 1024;
+	mallctl("heap.purge", NULL, NULL, NULL, 0);
+	char *var = malloc(size);
+	memset(var, 'x', size);
+	free(var);
+	uint64_t cached = read_stat("stats.huge.cached");
+	// the cached mapping is reused, with its pages purged
+	char *again = malloc(size);
+	uint64_t reused = read_stat("stats.huge.cached");
+	free(again);
+	uint64_t mapped = read_stat("stats.mapped");
+	int error = mallctl("heap.purge", NULL, NULL, NULL, 0);
+
+	ASSERT_TRUE("TEST 59 - a freed huge region should be reused, and "
+	            "unmapped once it decays or is purged",
+	            cached == 1 && again == var && reused == 0 && !error &&
+	                    read_stat("stats.huge.cached") == 0 &&
+	                    read_stat("stats.mapped") <= mapped - size);
+}
+
+static void
+test_an_empty_slab_is_kept_for_its_size_class()
+{
+	mallctl("heap.purge", NULL, NULL, NULL, 0);
+	uint64_t before = read_stat("stats.empty_slabs");
+	char *var = malloc(232);
+	char *var2 = malloc(232);
+	free(var);
+	free(var2);
+	mallctl("thread.tcache.flush", NULL, NULL, NULL, 0);
+	uint64_t kept = read_stat("stats.empty_slabs");
+	// the kept slab serves the size class again
+	char *again = malloc(232);
+	uint64_t reused = read_stat("stats.empty_slabs");
+	free(again);
+	mallctl("thread.tcache.flush", NULL, NULL, NULL, 0);
+	int error = mallctl("heap.purge", NULL, NULL, NULL, 0);
+
+	ASSERT_TRUE("TEST 60 - an empty slab should be kept for its size class "
+	            "until it decays or is purged",
+	            before == 0 && kept == 1 && reused == 0 && !error &&
+	                    read_stat("stats.empty_slabs") == 0);
+}
+
+// three of these fill a mid block, its tail is too small for another one
+#define MID_REGION_SIZE (300 * 1024)
+
+static void
+test_address_order_takes_the_lowest_free_region()
+{
+#ifdef ADDRESS_FIT
+	char *vars[6];
+	for (int i = 0; i < 6; i++) {
+		vars[i] = malloc(MID_REGION_SIZE);
+	}
+	// one hole in each of the two blocks, whatever order they were mapped
+	free(vars[1]);
+	free(vars[4]);
+	char *lowest = vars[1] < vars[4] ? vars[1] : vars[4];
+	char *var = malloc(MID_REGION_SIZE);
+
+	ASSERT_TRUE("TEST 62 - address ordered first fit should take the free "
+	            "region with the lowest address",
+	            var == lowest);
+	free(var);
+	free(lowest == vars[1] ? vars[4] : vars[1]);
+	for (int i = 0; i < 6; i++) {
+		if (i != 1 && i != 4) {
+			free(vars[i]);
+		}
+	}
+#endif
+}
+
+static void
+test_next_fit_goes_on_from_the_last_region()
+{
+#ifdef NEXT_FIT
+	char *vars[6];
+	for (int i = 0; i < 6; i++) {
+		vars[i] = malloc(MID_REGION_SIZE);
+	}
+	free(vars[3]);
+	// the search ends on the hole of the second block
+	char *var = malloc(MID_REGION_SIZE);
+	free(vars[0]);
+	free(vars[4]);
+	// goes on after the last region instead of taking the first hole
+	char *next = malloc(MID_REGION_SIZE);
+	// there is nothing else after it, so it wraps to the first block
+	char *wrapped = malloc(MID_REGION_SIZE);
+
+	ASSERT_TRUE("TEST 63 - next fit should go on from the last region it "
+	            "took, and wrap to the first block",
+	            var == vars[3] && next == vars[4] && wrapped == vars[0]);
+	free(var);
+	free(next);
+	free(wrapped);
+	for (int i = 0; i < 6; i++) {
+		if (i != 0 && i != 3 && i != 4) {
+			free(vars[i]);
+		}
+	}
+#endif
+}
+
+// allocates and frees regions of random sizes, bigger than the ones kept
+// by the thread cache, so that their lists change in many ways. With
+// USE_DEBUG every best fit search checks the tree against its blocks
+static void
+test_random_allocations_keep_their_contents()
+{
+	char *vars[500] = { NULL };
+	size_t sizes[500];
+	unsigned int seed = 12345;
+	bool intact = true;
+
+	for (int i = 0; i < 20000 && intact; i++) {
+		seed = seed * 1103515245 + 12345;
+		int slot = (seed >> 8) % 500;
+		if (vars[slot]) {
+			char value = slot % 128;
+			intact = vars[slot][0] == value &&
+			         vars[slot][sizes[slot] - 1] == value;
+			free(vars[slot]);
+			vars[slot] = NULL;
+			continue;
+		}
+		seed = seed * 1103515245 + 12345;
+		sizes[slot] = 1100 + (seed >> 8) % 40000;
+		vars[slot] = malloc(sizes[slot]);
+		intact = vars[slot] != NULL;
+		if (intact) {
+			memset(vars[slot], slot % 128, sizes[slot]);
+		}
+	}
+
+	ASSERT_TRUE("TEST 64 - regions of random sizes allocated and freed "
+	            "should keep their contents",
+	            intact);
+	for (int i = 0; i < 500; i++) {
+		free(vars[i]);
+	}
+}
+
+// prints the settings in effect, run by test_malloc_conf_is_parsed in a
+// new process that reads MALLOC_CONF
+static void
+print_settings(void)
+{
+	size_t little_size = 0;
+	int max_little = 0;
+	long decay = 0;
+	const char *fit = NULL;
+	const char *huge = NULL;
+	size_t len = sizeof(little_size);
+	mallctl("opt.little_block_size", &little_size, &len, NULL, 0);
+	len = sizeof(max_little);
+	mallctl("opt.max_little_blocks", &max_little, &len, NULL, 0);
+	len = sizeof(decay);
+	mallctl("opt.decay_ms", &decay, &len, NULL, 0);
+	len = sizeof(fit);
+	mallctl("opt.fit_large", &fit, &len, NULL, 0);
+	len = sizeof(huge);
+	mallctl("opt.huge_pages", &huge, &len, NULL, 0);
+	printf("%zu %d %ld %s %s\n", little_size, max_little, decay, fit, huge);
+}
+
+// allocates mid regions that take a block each, run by
+// test_hugetlb_falls_back_to_transparent_pages with huge_pages:hugetlb
+static void
+print_huge_blocks(void)
+{
+	char *vars[3];
+	bool ok = true;
+	for (int i = 0; i < 3; i++) {
+		vars[i] = malloc(1536 * 1024);
+		ok &= vars[i] != NULL;
+		if (vars[i]) {
+			memset(vars[i], 'x', 1536 * 1024);
+		}
+	}
+	uint64_t huge_bytes = 0;
+	size_t len = sizeof(huge_bytes);
+	mallctl("stats.mid.huge_pages", &huge_bytes, &len, NULL, 0);
+	printf("%d %lu\n", ok, (unsigned long) huge_bytes);
+	for (int i = 0; i < 3; i++) {
+		free(vars[i]);
+	}
+}
+
+// runs this program with MALLOC_CONF set to `conf` and `mode` as its
+// argument, and reads what it prints
+static bool
+run_with_conf(const char *conf, const char *mode, char *output, size_t len)
+{
+	int fds[2];
+	if (pipe(fds)) {
+		return false;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+		setenv("MALLOC_CONF", conf, 1);
+		execl("/proc/self/exe", "malloc.test", mode, (char *) NULL);
+		_exit(1);
+	}
+	close(fds[1]);
+	size_t read_bytes = 0;
+	ssize_t n = 1;
+	while (read_bytes < len - 1 && n > 0) {
+		n = read(fds[0], output + read_bytes, len - 1 - read_bytes);
+		read_bytes += n > 0 ? n : 0;
+	}
+	output[read_bytes] = '\0';
+	close(fds[0]);
+	int status;
+	return pid > 0 && waitpid(pid, &status, 0) == pid &&
+	       WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void
+test_malloc_conf_is_parsed()
+{
+	char defaults[256];
+	char valid[256];
+	char unknown[256];
+	char bad_fit[256];
+	char bad_suffix[256];
+	char no_value[256];
+	char overflow[256];
+	const char *mode = "settings";
+	bool ran = run_with_conf("", mode, defaults, sizeof(defaults));
+	ran &= run_with_conf("little_block_size:32k,max_little_blocks:7,"
+	                     "decay_ms:250,fit_large:first,huge_pages:thp",
+	                     mode,
+	                     valid,
+	                     sizeof(valid));
+	// the invalid entries are reported and leave the defaults
+	ran &= run_with_conf("bogus:1", mode, unknown, sizeof(unknown));
+	ran &= run_with_conf("fit:bogus", mode, bad_fit, sizeof(bad_fit));
+	ran &= run_with_conf("decay_ms:12x",
+	                     mode,
+	                     bad_suffix,
+	                     sizeof(bad_suffix));
+	ran &= run_with_conf("decay_ms", mode, no_value, sizeof(no_value));
+	ran &= run_with_conf("little_block_size:99999999999999g",
+	                     mode,
+	                     overflow,
+	                     sizeof(overflow));
+
+	bool reported = strstr(unknown, "invalid option bogus:1") &&
+	                strstr(bad_fit, "invalid option fit:bogus") &&
+	                strstr(bad_suffix, "invalid option decay_ms:12x") &&
+	                strstr(no_value, "invalid option decay_ms") &&
+	                strstr(overflow, "invalid option little_block_size");
+
+	ASSERT_TRUE("TEST 61 - the valid MALLOC_CONF entries should be applied, "
+	            "and the invalid ones reported and ignored",
+	            ran && reported &&
+	                    strstr(valid, "32768 7 250 first thp\n") &&
+	                    strstr(unknown, defaults) &&
+	                    strstr(bad_fit, defaults) &&
+	                    strstr(bad_suffix, defaults) &&
+	                    strstr(no_value, defaults) &&
+	                    strstr(overflow, defaults));
+}
+
+static void
+test_hugetlb_falls_back_to_transparent_pages()
+{
+	char output[256];
+	bool ran = run_with_conf("huge_pages:hugetlb",
+	                         "huge_blocks",
+	                         output,
+	                         sizeof(output));
+	int ok = 0;
+	unsigned long huge_bytes = 0;
+	bool parsed = sscanf(output, "%d %lu", &ok, &huge_bytes) == 2;
+
+	// without reserved huge pages (/proc/sys/vm/nr_hugepages is 0 by
+	// default) the first MAP_HUGETLB mapping fails, and that block and the
+	// next ones are mapped for transparent huge pages instead
+	ASSERT_TRUE("TEST 65 - with hugetlb huge pages the blocks should be "
+	            "mapped even if there are no reserved huge pages",
+	            ran && parsed && ok && huge_bytes >= 3 * 2 * 1024 * 1024);
+}
 
 int
-main(void)
+main(int argc, char **argv)
 {
+	if (argc > 1 && !strcmp(argv[1], "settings")) {
+		print_settings();
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "huge_blocks")) {
+		print_huge_blocks();
+		return 0;
+	}
+
 	run_test(successful_malloc_returns_non_null_pointer);
 	run_test(correct_copied_value);
 	run_test(correct_amount_of_mallocs);
@@ -439,6 +1491,45 @@ main(void)
 	run_test(test_errno_malloc);
 	run_test(test_errno_calloc);
 	run_test(test_errno_realloc);
+	run_test(test_free_regions_are_reused);
+	run_test(test_concurrent_mallocs_and_frees);
+	run_test(test_thread_cache_reuses_small_regions);
+	run_test(test_threads_use_different_arenas);
+	run_test(test_tiny_objects_use_slabs);
+	run_test(test_realloc_grows_in_place);
+	run_test(test_realloc_shrink_joins_next_free_region);
+	run_test(test_realloc_remaps_large_regions);
+	run_test(test_huge_regions_have_their_own_mapping);
+	run_test(test_huge_regions_after_max_large_blocks);
+	run_test(test_empty_blocks_are_reused);
+	run_test(test_calloc_overflow);
+	run_test(test_calloc_clears_reused_memory);
+	run_test(test_pointers_are_aligned_to_16_bytes);
+	run_test(test_aligned_allocations);
+	run_test(test_malloc_usable_size);
+	run_test(test_region_headers_are_compact);
+	run_test(test_reallocarray);
+	run_test(test_fork_while_other_thread_allocates);
+	run_test(test_mallctl_counts_allocated_bytes);
+	run_test(test_stats_report_fragmentation);
+	run_test(test_heap_profile_tracks_live_samples);
+	run_test(test_batch_allocates_and_frees_runs);
+	run_test(test_sized_free_reuses_size_class);
+	run_test(test_numa_nodes_report_their_blocks);
+	run_test(test_remote_frees_go_back_to_their_arena);
+	run_test(test_reserved_blocks_are_taken_before_mapping);
+	run_test(test_sizes_between_2_and_4_gib_are_served);
+	run_test(test_regions_freed_twice_are_not_handed_out_twice);
+	run_test(test_regions_of_4_gib_shrink_into_the_free_index);
+	run_test(test_alignments_past_the_region_size_fail);
+	run_test(test_free_pages_are_purged_on_demand);
+	run_test(test_huge_regions_are_cached_then_released);
+	run_test(test_an_empty_slab_is_kept_for_its_size_class);
+	run_test(test_malloc_conf_is_parsed);
+	run_test(test_address_order_takes_the_lowest_free_region);
+	run_test(test_next_fit_goes_on_from_the_last_region);
+	run_test(test_random_allocations_keep_their_contents);
+	run_test(test_hugetlb_falls_back_to_transparent_pages);
 
 	return 0;
 }
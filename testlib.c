@@ -10,11 +10,24 @@ void
 run_test(test_case_t test_case)
 {
 	pid_t p;
+	int status;
 
 	if ((p = fork()) == 0) {
 		test_case();
 		exit(EXIT_SUCCESS);
 	}
 
-	assert(wait(NULL) > 0);
+	assert(waitpid(p, &status, 0) > 0);
+	// a test that crashes would otherwise go unnoticed
+	if (WIFSIGNALED(status)) {
+		printfmt("test killed by signal %d: %sFAIL%s\n",
+		         WTERMSIG(status),
+		         COLOR_RED,
+		         COLOR_RESET);
+	} else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+		printfmt("test exited with status %d: %sFAIL%s\n",
+		         WEXITSTATUS(status),
+		         COLOR_RED,
+		         COLOR_RESET);
+	}
 }
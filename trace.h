@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// format of the allocation traces written when MALLOC_TRACE_FILE is set:
+// a header followed by fixed size records, the records of each thread are
+// in order but the ones of different threads are only ordered by time
+
+#define TRACE_MAGIC 0x4352544d  // "MTRC"
+#define TRACE_VERSION 1
+
+enum trace_op {
+	TRACE_MALLOC,
+	TRACE_CALLOC,
+	TRACE_REALLOC,
+	TRACE_FREE,
+	TRACE_MEMALIGN,
+};
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t unused;
+};
+
+struct trace_record {
+	uint64_t time;      // nanoseconds since the trace started
+	uint64_t address;   // returned or freed pointer, 0 if it failed
+	uint64_t argument;  // old pointer of realloc, alignment of memalign
+	uint32_t size;      // requested size, saturated to UINT32_MAX
+	uint16_t thread;
+	uint8_t op;
+	uint8_t unused;
+};
+
+_Static_assert(sizeof(struct trace_record) == 32, "trace record is not packed");
+
+#endif  // TRACE_H